@@ -1,10 +1,40 @@
+#include <dirent.h>
+#include <fcntl.h>
 #include <fnmatch.h>
+#include <getopt.h>
+#include <regex.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <zlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #define printe(...)                   \
@@ -14,6 +44,17 @@
 
 namespace fs = std::filesystem;
 
+// The directory relative paths are resolved against. Empty means the
+// current directory; --serve sets it to each client's directory instead
+// of calling chdir, which would change it under concurrent requests.
+static std::string base_dir;
+
+static std::string resolve_path(const std::string& path) {
+  if (base_dir.empty() || (!path.empty() && path[0] == '/'))
+    return path;
+  return base_dir + "/" + path;
+}
+
 struct FileDeleter {
   void operator()(FILE* file) const {
     if (file) {
@@ -24,22 +65,291 @@ struct FileDeleter {
 
 typedef std::unique_ptr<FILE, FileDeleter> FILE_ptr;
 
+enum OutputFormat {
+  FORMAT_PLAIN,
+  FORMAT_XML,
+  FORMAT_MARKDOWN,
+  FORMAT_JSON,
+  FORMAT_JSONL,
+};
+
+enum EncodingPolicy {
+  ENCODING_AUTO,
+  ENCODING_REPLACE,
+  ENCODING_LATIN1,
+  ENCODING_SKIP,
+  ENCODING_KEEP,
+};
+
+enum SortOrder {
+  SORT_NONE,
+  SORT_PATH,
+  SORT_SIZE,
+  SORT_MTIME,
+};
+
+enum TruncateMode {
+  TRUNCATE_HEAD,
+  TRUNCATE_TAIL,
+  TRUNCATE_HEAD_TAIL,
+};
+
+// Parses a byte count with an optional K, M or G (binary) suffix.
+static bool parse_size(const char* arg, uint64_t& size) {
+  char* end;
+  errno = 0;
+  size = strtoull(arg, &end, 10);
+  if (end == arg || errno)
+    return false;
+  switch (*end) {
+    case 'k':
+    case 'K':
+      size <<= 10;
+      end++;
+      break;
+    case 'm':
+    case 'M':
+      size <<= 20;
+      end++;
+      break;
+    case 'g':
+    case 'G':
+      size <<= 30;
+      end++;
+      break;
+  }
+  return *end == '\0';
+}
+
+// Parses a plain decimal count, such as a number of files; unlike sizes,
+// counts take no suffix.
+static bool parse_count(const char* arg, uint64_t& count) {
+  if (!isdigit(static_cast<unsigned char>(*arg)))
+    return false;
+  char* end;
+  errno = 0;
+  count = strtoull(arg, &end, 10);
+  return *end == '\0' && !errno;
+}
+
+// Parses a point in time for --newer-than/--older-than: "@<epoch>", a
+// date ("2024-05-01" or "2024-05-01T12:00:00", local time) or an age
+// such as "90s", "30m", "12h", "7d" or "2w" before now.
+static bool parse_time(const char* arg, int64_t& when) {
+  char* end;
+  if (arg[0] == '@') {
+    errno = 0;
+    when = strtoll(arg + 1, &end, 10);
+    return end != arg + 1 && !*end && !errno;
+  }
+
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char* rest = strptime(arg, "%Y-%m-%d", &tm);
+  if (rest && *rest == 'T')
+    rest = strptime(rest, "T%H:%M:%S", &tm);
+  if (rest && !*rest) {
+    tm.tm_isdst = -1;
+    when = mktime(&tm);
+    return true;
+  }
+
+  errno = 0;
+  int64_t amount = strtoll(arg, &end, 10);
+  if (end == arg || errno || amount < 0)
+    return false;
+  static const struct {
+    char unit;
+    int64_t seconds;
+  } units[] = {{'s', 1}, {'m', 60}, {'h', 3600}, {'d', 86400}, {'w', 604800}};
+  for (const auto& u : units) {
+    if (end[0] == u.unit && !end[1]) {
+      when = time(nullptr) - amount * u.seconds;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Checks that a --split-* output file name holds exactly one integer
+// conversion (%d or %i, with optional flags and width) for the part
+// number, and no other conversions.
+static bool is_part_pattern(const std::string& pattern) {
+  int conversions = 0;
+  for (size_t i = 0; i < pattern.size(); i++) {
+    if (pattern[i] != '%')
+      continue;
+    if (++i < pattern.size() && pattern[i] == '%')
+      continue;
+    while (i < pattern.size() && strchr("-+ #0", pattern[i]))
+      i++;
+    while (i < pattern.size() && pattern[i] >= '0' && pattern[i] <= '9')
+      i++;
+    if (i == pattern.size() || (pattern[i] != 'd' && pattern[i] != 'i'))
+      return false;
+    conversions++;
+  }
+  return conversions == 1;
+}
+
+class GrepFilter;
+class GlobSet;
+
 class Opt {
  public:
   std::vector<std::string> paths;
   std::vector<std::string> extensions;
   std::vector<std::string> ignore_patterns;
+  std::shared_ptr<const GlobSet> ignore_globs;
   bool include_hidden = false;
   bool ignore_gitignore = false;
-  bool claude_xml = false;
+  OutputFormat format = FORMAT_PLAIN;
+  bool line_numbers = false;
+  bool count_tokens = false;
+  uint64_t max_file_bytes = 0;
+  uint64_t max_file_lines = 0;
+  TruncateMode truncate = TRUNCATE_HEAD;
+  bool strip_comments = false;
+  bool collapse_whitespace = false;
+  SortOrder sort = SORT_NONE;
+  EncodingPolicy invalid_encoding = ENCODING_AUTO;
+  std::vector<std::string> grep_patterns;
+  std::vector<std::string> grep_not_patterns;
+  std::shared_ptr<const GrepFilter> grep;
+  uint64_t min_size = 0;
+  uint64_t max_size = UINT64_MAX;
+  int64_t newer_than = INT64_MIN;
+  int64_t older_than = INT64_MAX;
+  bool prune_dirs = false;
+  uint64_t max_output_lag = 64 << 20;
+  uint64_t prefetch = 0;
+  std::string files_from;
+  bool null_separated = false;
+  uint64_t jobs = 0;
+  std::string serve;
+  uint64_t cache_size = 512 << 20;
+  std::string send_memfd;
+  uint64_t split_tokens = 0;
+  uint64_t split_bytes = 0;
+  uint64_t chunk_bytes = 0;
+  uint64_t max_chunk_bytes = 0;
+  bool outline = false;
+
+  bool has_stat_filters() const {
+    return min_size || max_size != UINT64_MAX || newer_than != INT64_MIN ||
+           older_than != INT64_MAX;
+  }
+
+  // Metadata filters, checked from stat data before a file is opened.
+  bool passes_stat_filters(uint64_t size, int64_t mtime) const {
+    return size >= min_size && size <= max_size && mtime >= newer_than &&
+           mtime <= older_than;
+  }
   std::string output_file;
+  std::string git_rev;
+  std::string changed_since;
+  bool dirty = false;
 
   int init(int argc, char** argv) { return parse(argc, argv); }
 
  private:
+  enum {
+    OPT_GIT_REV = 256,
+    OPT_CHANGED_SINCE,
+    OPT_DIRTY,
+    OPT_FORMAT,
+    OPT_COUNT_TOKENS,
+    OPT_MAX_FILE_BYTES,
+    OPT_MAX_FILE_LINES,
+    OPT_TRUNCATE,
+    OPT_STRIP_COMMENTS,
+    OPT_COLLAPSE_WHITESPACE,
+    OPT_SORT,
+    OPT_INVALID_ENCODING,
+    OPT_GREP,
+    OPT_GREP_NOT,
+    OPT_MIN_SIZE,
+    OPT_MAX_SIZE,
+    OPT_NEWER_THAN,
+    OPT_OLDER_THAN,
+    OPT_PRUNE_DIRS,
+    OPT_MAX_OUTPUT_LAG,
+    OPT_PREFETCH,
+    OPT_IGNORE,
+    OPT_FILES_FROM,
+    OPT_SERVE,
+    OPT_CACHE_SIZE,
+    OPT_SEND_MEMFD,
+    OPT_SPLIT_TOKENS,
+    OPT_SPLIT_BYTES,
+    OPT_CHUNK_BYTES,
+    OPT_MAX_CHUNK_BYTES,
+    OPT_OUTLINE,
+  };
+
+  bool parse_format(const std::string& name) {
+    static const struct {
+      const char* name;
+      OutputFormat format;
+    } formats[] = {
+        {"plain", FORMAT_PLAIN}, {"xml", FORMAT_XML},
+        {"markdown", FORMAT_MARKDOWN}, {"json", FORMAT_JSON},
+        {"jsonl", FORMAT_JSONL},
+    };
+    for (const auto& f : formats) {
+      if (name == f.name) {
+        format = f.format;
+        return true;
+      }
+    }
+    return false;
+  }
+
   int parse(int argc, char** argv) {
+    static const struct option long_options[] = {
+        {"markdown", no_argument, nullptr, 'm'},
+        {"line-numbers", no_argument, nullptr, 'n'},
+        {"ignore", required_argument, nullptr, OPT_IGNORE},
+        {"files-from", required_argument, nullptr, OPT_FILES_FROM},
+        {"null", no_argument, nullptr, '0'},
+        {"jobs", required_argument, nullptr, 'j'},
+        {"serve", required_argument, nullptr, OPT_SERVE},
+        {"cache-size", required_argument, nullptr, OPT_CACHE_SIZE},
+        {"send-memfd", required_argument, nullptr, OPT_SEND_MEMFD},
+        {"split-tokens", required_argument, nullptr, OPT_SPLIT_TOKENS},
+        {"split-bytes", required_argument, nullptr, OPT_SPLIT_BYTES},
+        {"chunk-bytes", required_argument, nullptr, OPT_CHUNK_BYTES},
+        {"max-chunk-bytes", required_argument, nullptr, OPT_MAX_CHUNK_BYTES},
+        {"outline", no_argument, nullptr, OPT_OUTLINE},
+        {"format", required_argument, nullptr, OPT_FORMAT},
+        {"count-tokens", no_argument, nullptr, OPT_COUNT_TOKENS},
+        {"max-file-bytes", required_argument, nullptr, OPT_MAX_FILE_BYTES},
+        {"max-file-lines", required_argument, nullptr, OPT_MAX_FILE_LINES},
+        {"truncate", required_argument, nullptr, OPT_TRUNCATE},
+        {"strip-comments", no_argument, nullptr, OPT_STRIP_COMMENTS},
+        {"collapse-whitespace", no_argument, nullptr,
+         OPT_COLLAPSE_WHITESPACE},
+        {"sort", required_argument, nullptr, OPT_SORT},
+        {"invalid-encoding", required_argument, nullptr,
+         OPT_INVALID_ENCODING},
+        {"grep", required_argument, nullptr, OPT_GREP},
+        {"grep-not", required_argument, nullptr, OPT_GREP_NOT},
+        {"min-size", required_argument, nullptr, OPT_MIN_SIZE},
+        {"max-size", required_argument, nullptr, OPT_MAX_SIZE},
+        {"newer-than", required_argument, nullptr, OPT_NEWER_THAN},
+        {"older-than", required_argument, nullptr, OPT_OLDER_THAN},
+        {"prune-dirs", no_argument, nullptr, OPT_PRUNE_DIRS},
+        {"max-output-lag", required_argument, nullptr, OPT_MAX_OUTPUT_LAG},
+        {"prefetch", required_argument, nullptr, OPT_PREFETCH},
+        {"git-rev", required_argument, nullptr, OPT_GIT_REV},
+        {"changed-since", required_argument, nullptr, OPT_CHANGED_SINCE},
+        {"dirty", no_argument, nullptr, OPT_DIRTY},
+        {nullptr, 0, nullptr, 0},
+    };
+
     int opt;
-    while ((opt = getopt(argc, argv, "e:o:ciH")) != -1) {
+    while ((opt = getopt_long(argc, argv, "e:o:cimnH0j:", long_options,
+                              nullptr)) != -1) {
       switch (opt) {
         case 'e':
           extensions.push_back(optarg);
@@ -47,30 +357,242 @@ class Opt {
         case 'i':
           ignore_gitignore = true;
           break;
+        case OPT_IGNORE:
+          ignore_patterns.push_back(optarg);
+          break;
+        case OPT_FILES_FROM:
+          files_from = optarg;
+          break;
+        case '0':
+          null_separated = true;
+          break;
+        case OPT_SERVE:
+          serve = optarg;
+          break;
+        case OPT_SEND_MEMFD:
+          send_memfd = optarg;
+          break;
+        case OPT_SPLIT_TOKENS:
+          if (!parse_count(optarg, split_tokens)) {
+            printe("Invalid token count: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_SPLIT_BYTES:
+          if (!parse_size(optarg, split_bytes)) {
+            printe("Invalid size: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_CHUNK_BYTES:
+        case OPT_MAX_CHUNK_BYTES:
+          if (!parse_size(optarg, opt == OPT_CHUNK_BYTES ? chunk_bytes
+                                                          : max_chunk_bytes)) {
+            printe("Invalid size: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_OUTLINE:
+          outline = true;
+          break;
+        case OPT_CACHE_SIZE:
+          if (!parse_size(optarg, cache_size)) {
+            printe("Invalid size: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case 'j':
+          if (!parse_count(optarg, jobs)) {
+            printe("Invalid job count: %s\n", optarg);
+            return 1;
+          }
+          break;
         case 'o':
           output_file = optarg;
           break;
         case 'c':
-          claude_xml = true;
+          format = FORMAT_XML;
           break;
         case 'H':
           include_hidden = true;
           break;
+        case 'm':
+          format = FORMAT_MARKDOWN;
+          break;
+        case 'n':
+          line_numbers = true;
+          break;
+        case OPT_FORMAT:
+          if (!parse_format(optarg)) {
+            printe("Unknown output format: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_COUNT_TOKENS:
+          count_tokens = true;
+          break;
+        case OPT_MAX_FILE_BYTES:
+          if (!parse_size(optarg, max_file_bytes)) {
+            printe("Invalid size: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_MAX_FILE_LINES:
+          if (!parse_count(optarg, max_file_lines)) {
+            printe("Invalid line count: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_TRUNCATE:
+          if (!strcmp(optarg, "head")) {
+            truncate = TRUNCATE_HEAD;
+          } else if (!strcmp(optarg, "tail")) {
+            truncate = TRUNCATE_TAIL;
+          } else if (!strcmp(optarg, "head+tail")) {
+            truncate = TRUNCATE_HEAD_TAIL;
+          } else {
+            printe("Unknown truncate mode: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_STRIP_COMMENTS:
+          strip_comments = true;
+          break;
+        case OPT_COLLAPSE_WHITESPACE:
+          collapse_whitespace = true;
+          break;
+        case OPT_SORT:
+          if (!strcmp(optarg, "path")) {
+            sort = SORT_PATH;
+          } else if (!strcmp(optarg, "size")) {
+            sort = SORT_SIZE;
+          } else if (!strcmp(optarg, "mtime")) {
+            sort = SORT_MTIME;
+          } else {
+            printe("Unknown sort order: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_INVALID_ENCODING:
+          if (!strcmp(optarg, "auto")) {
+            invalid_encoding = ENCODING_AUTO;
+          } else if (!strcmp(optarg, "replace")) {
+            invalid_encoding = ENCODING_REPLACE;
+          } else if (!strcmp(optarg, "latin1")) {
+            invalid_encoding = ENCODING_LATIN1;
+          } else if (!strcmp(optarg, "skip")) {
+            invalid_encoding = ENCODING_SKIP;
+          } else if (!strcmp(optarg, "keep")) {
+            invalid_encoding = ENCODING_KEEP;
+          } else {
+            printe("Unknown encoding policy: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_GREP:
+          grep_patterns.push_back(optarg);
+          break;
+        case OPT_GREP_NOT:
+          grep_not_patterns.push_back(optarg);
+          break;
+        case OPT_MIN_SIZE:
+        case OPT_MAX_SIZE:
+          if (!parse_size(optarg, opt == OPT_MIN_SIZE ? min_size : max_size)) {
+            printe("Invalid size: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_NEWER_THAN:
+        case OPT_OLDER_THAN:
+          if (!parse_time(optarg,
+                          opt == OPT_NEWER_THAN ? newer_than : older_than)) {
+            printe("Invalid time: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_PRUNE_DIRS:
+          prune_dirs = true;
+          break;
+        case OPT_MAX_OUTPUT_LAG:
+          if (!parse_size(optarg, max_output_lag)) {
+            printe("Invalid size: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_PREFETCH:
+          if (!parse_count(optarg, prefetch)) {
+            printe("Invalid file count: %s\n", optarg);
+            return 1;
+          }
+          break;
+        case OPT_GIT_REV:
+          git_rev = optarg;
+          break;
+        case OPT_CHANGED_SINCE:
+          changed_since = optarg;
+          break;
+        case OPT_DIRTY:
+          dirty = true;
+          break;
         default:
           fprintf(
               stderr,
-              "Usage: %s [-e extension] [-i ignore_pattern] [-o output_file] "
-              "[-c] [-H] [paths...]\n",
+              "Usage: %s [-e extension] [--ignore glob] [-i] [-o output_file] "
+              "[-c] [-m] [-H] [-n] [--format fmt] [--count-tokens] "
+              "[--max-file-bytes n] [--max-file-lines n] "
+              "[--truncate head|tail|head+tail] "
+              "[--strip-comments] [--collapse-whitespace] "
+              "[--sort path|size|mtime] "
+              "[--invalid-encoding auto|replace|latin1|skip|keep] "
+              "[--grep regex] [--grep-not regex] "
+              "[--min-size n] [--max-size n] [--newer-than time] "
+              "[--older-than time] [--prune-dirs] [--max-output-lag n] "
+              "[--prefetch n] [--files-from file|-] [-0] [-j n] "
+              "[--serve socket] [--cache-size n] [--send-memfd socket|-] "
+              "[--split-tokens n] [--split-bytes n] [--chunk-bytes n] "
+              "[--max-chunk-bytes n] [--outline] "
+              "[--git-rev rev] [--changed-since rev] [--dirty] "
+              "[paths...]\n",
               argv[0]);
           return 1;
       }
     }
 
+    if (!git_rev.empty() && (dirty || !changed_since.empty())) {
+      printe("--git-rev cannot be combined with --dirty or --changed-since\n");
+      return 1;
+    }
+    if (!git_rev.empty() && has_stat_filters()) {
+      printe("--git-rev cannot be combined with size or time filters\n");
+      return 1;
+    }
+    if (!send_memfd.empty() && !output_file.empty()) {
+      printe("--send-memfd cannot be combined with -o\n");
+      return 1;
+    }
+    if (max_chunk_bytes && max_chunk_bytes < chunk_bytes) {
+      printe("--max-chunk-bytes cannot be less than --chunk-bytes\n");
+      return 1;
+    }
+    if (outline && chunk_bytes) {
+      printe("--outline cannot be combined with --chunk-bytes\n");
+      return 1;
+    }
+    if (max_chunk_bytes && !chunk_bytes) {
+      printe("--max-chunk-bytes needs --chunk-bytes\n");
+      return 1;
+    }
+    if ((split_tokens || split_bytes) && !is_part_pattern(output_file)) {
+      printe("--split-tokens and --split-bytes need -o with a part number "
+             "pattern such as out-%%03d.xml\n");
+      return 1;
+    }
+
     for (int i = optind; i < argc; i++) {
       paths.push_back(argv[i]);
     }
 
-    if (paths.empty()) {
+    if (paths.empty() && files_from.empty()) {
       paths.push_back(".");
     }
 
@@ -78,21 +600,6 @@ class Opt {
   }
 };
 
-static bool should_ignore(const std::string& path,
-                          const std::vector<std::string>& gitignore_rules) {
-  for (const auto& rule : gitignore_rules) {
-    if (fnmatch(rule.c_str(), fs::path(path).filename().c_str(), 0) == 0) {
-      return true;
-    }
-    if (fs::is_directory(path) &&
-        fnmatch((fs::path(path).filename().string() + "/").c_str(),
-                rule.c_str(), 0) == 0) {
-      return true;
-    }
-  }
-  return false;
-}
-
 static ssize_t getdelim(std::string& lineptr, int delimiter, FILE* fp) {
   ssize_t cur_len = 0;
 
@@ -130,166 +637,6263 @@ static ssize_t getline(std::string& lineptr, FILE* stream) {
   return getdelim(lineptr, '\n', stream);
 }
 
-static std::vector<std::string> read_gitignore(const std::string& path) {
-  std::vector<std::string> rules;
-  std::string gitignore_path = path + "/.gitignore";
-  FILE_ptr file(fopen(gitignore_path.c_str(), "r"));
-  if (file) {
-    std::string line;
-    while (getline(line, file.get()) != -1) {
-      line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
-      line.erase(std::remove(line.begin(), line.end(), '\n'), line.end());
-      if (line.size() > 0 && line[0] != '#') {
-        rules.push_back(line);
+static bool bracket_class_matches(std::string_view name, unsigned char c) {
+  if (name == "alnum")
+    return isalnum(c);
+  if (name == "alpha")
+    return isalpha(c);
+  if (name == "blank")
+    return c == ' ' || c == '\t';
+  if (name == "cntrl")
+    return iscntrl(c);
+  if (name == "digit")
+    return isdigit(c);
+  if (name == "graph")
+    return isgraph(c);
+  if (name == "lower")
+    return islower(c);
+  if (name == "print")
+    return isprint(c);
+  if (name == "punct")
+    return ispunct(c);
+  if (name == "space")
+    return isspace(c);
+  if (name == "upper")
+    return isupper(c);
+  if (name == "xdigit")
+    return isxdigit(c);
+  return false;
+}
+
+// Matches one character against the bracket expression starting after
+// '['. Returns false in `valid` if the expression is unterminated, in
+// which case the '[' is an ordinary character.
+static bool bracket_matches(const char*& p,
+                            const char* pe,
+                            unsigned char c,
+                            bool& valid) {
+  const char* q = p;
+  bool negate = q < pe && (*q == '!' || *q == '^');
+  if (negate)
+    ++q;
+  bool matched = false;
+  for (bool first = true; q < pe && (first || *q != ']'); first = false) {
+    if (*q == '[' && q + 1 < pe && q[1] == ':') {
+      const char* end = static_cast<const char*>(
+          memmem(q + 2, pe - q - 2, ":]", 2));
+      if (end) {
+        matched |= bracket_class_matches(std::string_view(q + 2, end - q - 2),
+                                         c);
+        q = end + 2;
+        continue;
       }
     }
+    if (*q == '\\' && q + 1 < pe)
+      ++q;
+    unsigned char lo = *q++;
+    unsigned char hi = lo;
+    if (q + 1 < pe && *q == '-' && q[1] != ']') {
+      q += q[1] == '\\' && q + 2 < pe ? 2 : 1;
+      hi = *q++;
+    }
+    matched |= c >= lo && c <= hi;
   }
-  return rules;
+  valid = q < pe;
+  if (valid)
+    p = q + 1;
+  return matched != negate;
 }
 
-static void print_path(FILE* writer,
-                       const std::string& path,
-                       const std::string& content,
-                       bool xml) {
-  static int global_index = 1;
-  if (xml) {
-    fprintf(writer, "<document index=\"%d\">\n", global_index);
-    fprintf(writer, "<source>%s</source>\n", path.c_str());
-    fprintf(writer, "<document_content>\n%s\n</document_content>\n",
-            content.c_str());
-    fprintf(writer, "</document>\n");
-    global_index++;
-  } else {
-    fprintf(writer, "%s\n---\n%s\n---\n", path.c_str(), content.c_str());
+// Matches `t` against the glob `p` the way git's wildmatch does for
+// ignore rules: '*', '?' and brackets never match '/', while '**' as a
+// whole path segment matches any number of directories.
+static bool wildmatch(const char* start,
+                      const char* p,
+                      const char* pe,
+                      const char* t,
+                      const char* te) {
+  while (p < pe) {
+    unsigned char c = *p;
+    if (c == '*') {
+      const char* stars = p;
+      while (p < pe && *p == '*')
+        ++p;
+      bool segment = p - stars > 1 && (stars == start || stars[-1] == '/') &&
+                     (p == pe || *p == '/');
+      if (segment) {
+        if (p == pe)
+          return true;
+        ++p;
+        for (const char* s = t;;) {
+          if (wildmatch(start, p, pe, s, te))
+            return true;
+          s = static_cast<const char*>(memchr(s, '/', te - s));
+          if (!s)
+            return false;
+          ++s;
+        }
+      }
+      if (p == pe)
+        return !memchr(t, '/', te - t);
+      for (const char* s = t;; ++s) {
+        if (wildmatch(start, p, pe, s, te))
+          return true;
+        if (s == te || *s == '/')
+          return false;
+      }
+    }
+    if (t == te)
+      return false;
+    if (c == '?') {
+      if (*t == '/')
+        return false;
+      ++p;
+      ++t;
+      continue;
+    }
+    if (c == '[') {
+      const char* q = p + 1;
+      bool valid;
+      bool matched = bracket_matches(q, pe, *t, valid);
+      if (valid) {
+        if (!matched || *t == '/')
+          return false;
+        p = q;
+        ++t;
+        continue;
+      }
+    }
+    if (c == '\\' && p + 1 < pe)
+      c = *++p;
+    if (c != static_cast<unsigned char>(*t))
+      return false;
+    ++p;
+    ++t;
   }
+  return t == te;
 }
 
-static std::string read_file_content(const std::string& path) {
-  FILE_ptr file(fopen(path.c_str(), "r"));
-  if (file) {
-    fseek(file.get(), 0, SEEK_END);
-    size_t size = ftell(file.get());
-    rewind(file.get());
-    std::string content(size, ' ');
-    fread(&content[0], size, 1, file.get());
-    return content;
-  } else {
-    printe("Warning: Skipping file %s due to error opening file\n",
-           path.c_str());
-    return "";
-  }
+static bool wildmatch(const std::string& pattern, std::string_view text) {
+  const char* p = pattern.data();
+  return wildmatch(p, p, p + pattern.size(), text.data(),
+                   text.data() + text.size());
 }
 
-static bool should_ignore_file(const std::string& filename,
-                               const std::vector<std::string>& ignore_patterns,
-                               const std::vector<std::string>& extensions,
-                               bool include_hidden) {
-  if (!include_hidden && filename[0] == '.') {
-    return true;
+// The rules of one ignore file, compiled. Patterns without a slash match
+// an entry's name at any depth; the others are anchored to the directory
+// holding the file. Plain names, "*.ext" suffixes and "name*" prefixes
+// are compared directly and only the rest go through wildmatch.
+class IgnoreRules {
+ public:
+  enum Match { NONE, IGNORED, INCLUDED };
+
+  static std::shared_ptr<const IgnoreRules> parse(FILE* file) {
+    auto rules = std::make_shared<IgnoreRules>();
+    std::string line;
+    while (getline(line, file) != -1)
+      rules->add(line);
+    if (rules->rules_.empty())
+      return nullptr;
+    return rules;
+  }
+
+  // `rel` is the entry's path relative to the rule file's directory and
+  // is only needed when has_anchored() is true.
+  Match match(std::string_view rel, std::string_view name, bool is_dir) const {
+    for (auto it = rules_.rbegin(); it != rules_.rend(); ++it) {
+      if (it->dir_only && !is_dir)
+        continue;
+      if (it->matches(it->anchored ? rel : name))
+        return it->negate ? INCLUDED : IGNORED;
+    }
+    return NONE;
+  }
+
+  bool has_anchored() const { return has_anchored_; }
+
+ private:
+  struct Rule {
+    enum Kind : uint8_t { LITERAL, SUFFIX, PREFIX, GLOB };
+    std::string pattern;
+    Kind kind;
+    bool negate;
+    bool dir_only;
+    bool anchored;
+
+    bool matches(std::string_view text) const {
+      switch (kind) {
+        case LITERAL:
+          return text == pattern;
+        case SUFFIX:
+          return text.size() >= pattern.size() &&
+                 text.compare(text.size() - pattern.size(), pattern.size(),
+                              pattern) == 0;
+        case PREFIX:
+          return text.compare(0, pattern.size(), pattern) == 0;
+        case GLOB:
+          return wildmatch(pattern, text);
+      }
+      return false;
+    }
+  };
+
+  void add(std::string line) {
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+      line.pop_back();
+    // Trailing spaces are dropped unless escaped.
+    size_t end = line.size();
+    while (end > 0 && line[end - 1] == ' ' &&
+           !(end > 1 && line[end - 2] == '\\'))
+      --end;
+    line.resize(end);
+    if (line.empty() || line[0] == '#')
+      return;
+
+    Rule rule = {};
+    size_t begin = 0;
+    if (line[0] == '!') {
+      rule.negate = true;
+      begin = 1;
+    }
+    if (line.size() > begin + 1 && line.back() == '/') {
+      rule.dir_only = true;
+      line.pop_back();
+    }
+    size_t slash = line.find('/', begin);
+    rule.anchored = slash != std::string::npos;
+    if (slash == begin)
+      ++begin;
+    rule.pattern = line.substr(begin);
+    if (rule.pattern.empty())
+      return;
+
+    const char* kSpecial = "*?[\\";
+    size_t first = rule.pattern.find_first_of(kSpecial);
+    if (first == std::string::npos) {
+      rule.kind = Rule::LITERAL;
+    } else if (!rule.anchored && first == 0 && rule.pattern[0] == '*' &&
+               rule.pattern.size() > 1 &&
+               rule.pattern.find_first_of(kSpecial, 1) == std::string::npos) {
+      rule.kind = Rule::SUFFIX;
+      rule.pattern.erase(0, 1);
+    } else if (!rule.anchored && first == rule.pattern.size() - 1 &&
+               rule.pattern.back() == '*') {
+      rule.kind = Rule::PREFIX;
+      rule.pattern.pop_back();
+    } else {
+      rule.kind = Rule::GLOB;
+    }
+    has_anchored_ |= rule.anchored;
+    rules_.push_back(std::move(rule));
+  }
+
+  std::vector<Rule> rules_;
+  bool has_anchored_ = false;
+};
+
+// A set of basename globs, with fnmatch semantics, matched in one pass.
+// Patterns are bucketed by shape: exact names, "*.ext" extensions,
+// "prefix*" and "*suffix" are hash lookups (one per distinct prefix or
+// suffix length), and everything else is compiled into a single NFA run
+// bit-parallel over all patterns at once. The cost per name grows with
+// the number of distinct shapes, not the number of patterns.
+class GlobSet {
+ public:
+  GlobSet() = default;
+  GlobSet(const GlobSet&) = delete;
+  GlobSet& operator=(const GlobSet&) = delete;
+
+  void add(const std::string& pattern) {
+    const char* kSpecial = "*?[\\";
+    size_t first = pattern.find_first_of(kSpecial);
+    if (first == std::string::npos) {
+      exact_.insert(intern(pattern));
+      return;
+    }
+    if (pattern == "*") {
+      match_all_ = true;
+      return;
+    }
+    // Collating elements and equivalence classes are left to fnmatch.
+    if (pattern.find("[.") != std::string::npos ||
+        pattern.find("[=") != std::string::npos) {
+      fallback_.push_back(pattern);
+      return;
+    }
+    std::string rest = pattern.substr(1);
+    if (first == 0 && pattern[0] == '*' &&
+        rest.find_first_of(kSpecial) == std::string::npos) {
+      if (rest[0] == '.' && rest.find('.', 1) == std::string::npos)
+        extensions_.insert(intern(rest.substr(1)));
+      else
+        add_affix(suffixes_, intern(rest));
+      return;
+    }
+    if (first == pattern.size() - 1 && pattern.back() == '*') {
+      add_affix(prefixes_, intern(pattern.substr(0, first)));
+      return;
+    }
+    compile(pattern);
+  }
+
+  bool empty() const {
+    return !match_all_ && exact_.empty() && extensions_.empty() &&
+           prefixes_.empty() && suffixes_.empty() && states_ == 0 &&
+           fallback_.empty();
   }
 
-  for (const auto& pattern : ignore_patterns) {
-    if (fnmatch(pattern.c_str(), filename.c_str(), 0) == 0) {
+  bool matches(std::string_view name) const {
+    if (match_all_ || exact_.count(name))
+      return true;
+    size_t dot = name.rfind('.');
+    if (dot != std::string_view::npos && !extensions_.empty() &&
+        extensions_.count(name.substr(dot + 1)))
       return true;
+    for (const auto& bucket : prefixes_) {
+      if (name.size() >= bucket.first &&
+          bucket.second.count(name.substr(0, bucket.first)))
+        return true;
     }
+    for (const auto& bucket : suffixes_) {
+      if (name.size() >= bucket.first &&
+          bucket.second.count(name.substr(name.size() - bucket.first)))
+        return true;
+    }
+    if (states_ && run_nfa(name))
+      return true;
+    for (const auto& pattern : fallback_) {
+      if (fnmatch(pattern.c_str(), std::string(name).c_str(), 0) == 0)
+        return true;
+    }
+    return false;
   }
 
-  if (!extensions.empty()) {
-    for (const auto& ext : extensions) {
-      if (filename.size() >= ext.size() &&
-          filename.compare(filename.size() - ext.size(), ext.size(), ext) ==
-              0) {
-        return false;
+ private:
+  // The sets hold views into storage_, so lookups never build strings.
+  using StringSet = std::unordered_set<std::string_view>;
+  // Affixes grouped by length, so a name needs one lookup per length.
+  using AffixBuckets = std::vector<std::pair<size_t, StringSet>>;
+
+  std::string_view intern(std::string s) {
+    storage_.push_back(std::move(s));
+    return storage_.back();
+  }
+
+  static void add_affix(AffixBuckets& buckets, std::string_view affix) {
+    for (auto& bucket : buckets) {
+      if (bucket.first == affix.size()) {
+        bucket.second.insert(affix);
+        return;
       }
     }
-    return true;
+    buckets.emplace_back(affix.size(), StringSet{affix});
   }
 
-  return false;
-}
+  // Each pattern becomes a run of states, one per token plus a final
+  // accepting state. State i of a pattern is active once its first i
+  // tokens have matched; a '*' state stays active on any byte and also
+  // activates the next state without consuming one.
+  void compile(const std::string& pattern) {
+    std::vector<std::array<uint64_t, 4>> tokens;
+    std::vector<bool> stars;
+    const char* p = pattern.data();
+    const char* pe = p + pattern.size();
+    while (p < pe) {
+      std::array<uint64_t, 4> set = {};
+      auto add = [&](unsigned char c) { set[c >> 6] |= 1ull << (c & 63); };
+      if (*p == '*') {
+        while (p < pe && *p == '*')
+          ++p;
+        set.fill(~0ull);
+        tokens.push_back(set);
+        stars.push_back(true);
+        continue;
+      }
+      if (*p == '?') {
+        set.fill(~0ull);
+        ++p;
+      } else if (*p == '[') {
+        const char* q = p + 1;
+        bool valid;
+        bracket_matches(q, pe, 0, valid);
+        if (valid) {
+          for (int c = 1; c < 256; ++c) {
+            const char* r = p + 1;
+            if (bracket_matches(r, pe, c, valid))
+              add(c);
+          }
+          p = q;
+        } else {
+          add('[');
+          ++p;
+        }
+      } else {
+        if (*p == '\\' && p + 1 < pe)
+          ++p;
+        add(*p++);
+      }
+      tokens.push_back(set);
+      stars.push_back(false);
+    }
 
-static void process_file(const std::string& path,
-                         FILE* writer,
-                         bool claude_xml) {
-  std::string content = read_file_content(path);
-  if (!content.empty()) {
-    print_path(writer, path, content, claude_xml);
+    size_t base = states_;
+    states_ += tokens.size() + 1;
+    size_t words = (states_ + 63) / 64;
+    for (auto& mask : byte_masks_)
+      mask.resize(words);
+    start_.resize(words);
+    star_.resize(words);
+    accept_.resize(words);
+    auto set_bit = [](std::vector<uint64_t>& bits, size_t i) {
+      bits[i >> 6] |= 1ull << (i & 63);
+    };
+    set_bit(start_, base);
+    set_bit(accept_, base + tokens.size());
+    for (size_t i = 0; i < tokens.size(); ++i) {
+      if (stars[i])
+        set_bit(star_, base + i);
+      for (int c = 0; c < 256; ++c) {
+        if (tokens[i][c >> 6] >> (c & 63) & 1)
+          set_bit(byte_masks_[c], base + i);
+      }
+    }
   }
-}
 
-static void process_directory(const std::string& path,
-                              const std::vector<std::string>& extensions,
-                              bool include_hidden,
-                              bool ignore_gitignore,
-                              std::vector<std::string>& gitignore_rules,
-                              const std::vector<std::string>& ignore_patterns,
-                              FILE* writer,
-                              bool claude_xml) {
-  for (const auto& entry : fs::recursive_directory_iterator(path)) {
-    if (fs::is_directory(entry.status()))
-      continue;
+  // Adds the states reached from active '*' states without input.
+  void close(std::vector<uint64_t>& active) const {
+    uint64_t carry = 0;
+    for (size_t w = 0; w < active.size(); ++w) {
+      uint64_t stars = active[w] & star_[w];
+      uint64_t next = carry;
+      carry = stars >> 63;
+      active[w] |= stars << 1 | next;
+    }
+  }
 
-    std::string file_path = entry.path().string();
-    std::string filename = entry.path().filename().string();
-    if (should_ignore_file(filename, ignore_patterns, extensions,
-                           include_hidden))
-      continue;
+  bool run_nfa(std::string_view name) const {
+    size_t words = start_.size();
+    thread_local std::vector<uint64_t> active, next;
+    active.assign(start_.begin(), start_.end());
+    next.resize(words);
+    close(active);
+    for (unsigned char c : name) {
+      const std::vector<uint64_t>& mask = byte_masks_[c];
+      uint64_t carry = 0, any = 0;
+      for (size_t w = 0; w < words; ++w) {
+        uint64_t step = active[w] & mask[w];
+        uint64_t moved = (step & ~star_[w]) << 1 | carry;
+        carry = (step & ~star_[w]) >> 63;
+        next[w] = moved | (step & star_[w]);
+        any |= next[w];
+      }
+      if (!any)
+        return false;
+      close(next);
+      active.swap(next);
+    }
+    for (size_t w = 0; w < words; ++w) {
+      if (active[w] & accept_[w])
+        return true;
+    }
+    return false;
+  }
 
-    if (!ignore_gitignore && should_ignore(file_path, gitignore_rules))
-      continue;
+  std::list<std::string> storage_;
+  bool match_all_ = false;
+  StringSet exact_;
+  StringSet extensions_;
+  AffixBuckets prefixes_;
+  AffixBuckets suffixes_;
+  size_t states_ = 0;
+  std::array<std::vector<uint64_t>, 256> byte_masks_;
+  std::vector<uint64_t> start_;
+  std::vector<uint64_t> star_;
+  std::vector<uint64_t> accept_;
+  std::vector<std::string> fallback_;
+};
+
+// The ignore files in effect at one point of a directory walk, outermost
+// first, so deeper files and later rules take precedence. Each level
+// records where the path relative to its directory starts in the walk's
+// path buffer. Files above the walk root also record the root's path
+// relative to them, which is prepended for anchored rules.
+class IgnoreStack {
+ public:
+  void push(std::shared_ptr<const IgnoreRules> rules,
+            size_t base,
+            std::string outer = "") {
+    levels_.push_back({std::move(rules), base, std::move(outer)});
+  }
+
+  void pop() { levels_.pop_back(); }
+
+  // `path` holds the entry's full walk path with its name at `name_offset`.
+  bool ignored(const std::string& path, size_t name_offset, bool is_dir) const {
+    std::string_view name(path.data() + name_offset, path.size() - name_offset);
+    std::string joined;
+    for (auto it = levels_.rbegin(); it != levels_.rend(); ++it) {
+      std::string_view rel(path.data() + it->base, path.size() - it->base);
+      if (!it->outer.empty() && it->rules->has_anchored()) {
+        joined.assign(it->outer).append(rel.data(), rel.size());
+        rel = joined;
+      }
+      switch (it->rules->match(rel, name, is_dir)) {
+        case IgnoreRules::IGNORED:
+          return true;
+        case IgnoreRules::INCLUDED:
+          return false;
+        case IgnoreRules::NONE:
+          break;
+      }
+    }
+    return false;
+  }
+
+ private:
+  struct Level {
+    std::shared_ptr<const IgnoreRules> rules;
+    size_t base;
+    std::string outer;
+  };
+  std::vector<Level> levels_;
+};
 
-    process_file(file_path, writer, claude_xml);
+static std::shared_ptr<const IgnoreRules> read_gitignore(int dir_fd,
+                                                         const char* name) {
+  int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+  FILE_ptr file(fdopen(fd, "r"));
+  if (!file) {
+    close(fd);
+    return nullptr;
   }
+  return IgnoreRules::parse(file.get());
 }
 
-static void process_path(const std::string& path,
-                         const std::vector<std::string>& extensions,
-                         bool include_hidden,
-                         bool ignore_gitignore,
-                         std::vector<std::string>& gitignore_rules,
-                         const std::vector<std::string>& ignore_patterns,
-                         FILE* writer,
-                         bool claude_xml) {
-  if (fs::is_regular_file(path)) {
-    process_file(path, writer, claude_xml);
-  } else if (fs::is_directory(path)) {
-    process_directory(path, extensions, include_hidden, ignore_gitignore,
-                      gitignore_rules, ignore_patterns, writer, claude_xml);
+// Calls fn(offset) for every occurrence of c in data, testing 16 bytes per
+// step with SSE2 where available.
+template <typename Fn>
+static void scan_byte(const char* data, size_t size, char c, Fn fn) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; i + 16 <= size; i += 16) {
+    __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    while (mask) {
+      fn(i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i < size; i++) {
+    if (data[i] == c)
+      fn(i);
   }
 }
 
-int main(int argc, char** argv) {
-  Opt opt;
-  if (opt.init(argc, argv)) {
-    return 1;
+static size_t count_byte(const char* data, size_t size, char c) {
+  size_t count = 0;
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; i + 16 <= size; i += 16) {
+    __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    count += __builtin_popcount(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
   }
+#endif
+  for (; i < size; i++)
+    count += data[i] == c;
+  return count;
+}
 
-  std::vector<std::string> gitignore_rules;
-  FILE* writer = stdout;
-  FILE_ptr file_out;
-  if (!opt.output_file.empty()) {
-    file_out.reset(fopen(opt.output_file.c_str(), "w"));
-    writer = file_out.get();
+// The marker the content caps leave in place of what they elide. With -n
+// it also names the number of the line after it, so that the lines kept
+// from a file keep their numbers.
+static std::string elision_marker(uint64_t bytes, uint64_t next_line) {
+  std::string marker = "[... " + std::to_string(bytes) + " bytes elided";
+  if (next_line)
+    marker += ", next line " + std::to_string(next_line);
+  return marker + " ...]\n";
+}
+
+// The line number named by the elision marker [p, end), or 0 if the line
+// is not one.
+static size_t elision_next_line(const char* p, const char* end) {
+  if (end - p < 5 || end - p > 80 || memcmp(p, "[... ", 5) != 0)
+    return 0;
+  std::string line(p, end);
+  unsigned long long bytes, next;
+  int length = -1;
+  if (sscanf(line.c_str(), "[... %llu bytes elided, next line %llu ...]%n",
+             &bytes, &next, &length) != 2 ||
+      length != static_cast<int>(line.size()))
+    return 0;
+  return next;
+}
+
+// Writes content with every line prefixed by its right-aligned number,
+// padded to the width of the largest line number as files-to-prompt does.
+// Numbering starts at first_line and continues after an elision marker at
+// the line it names; the marker itself is not numbered. Prefixes and line
+// bodies are staged together and passed to sink in large blocks that
+// always end on a line boundary.
+template <typename Sink>
+static void write_numbered(const std::string& content,
+                           Sink sink,
+                           size_t first_line = 1) {
+  size_t lines = count_byte(content.data(), content.size(), '\n');
+  if (content.empty() || content.back() != '\n')
+    lines++;
+  size_t largest = 0;
+  size_t number = first_line - 1;
+  size_t numbered = 0;
+  for (size_t pos = 0; (pos = content.find("[... ", pos)) != std::string::npos;
+       pos++) {
+    if (pos && content[pos - 1] != '\n')
+      continue;
+    size_t end = content.find('\n', pos);
+    if (end == std::string::npos)
+      end = content.size();
+    size_t next = elision_next_line(content.data() + pos,
+                                    content.data() + end);
+    if (!next)
+      continue;
+    size_t index = count_byte(content.data(), pos, '\n');
+    number += index - numbered;
+    largest = std::max(largest, number);
+    number = next - 1;
+    numbered = index + 1;
   }
+  if (lines > numbered)
+    largest = std::max(largest, number + lines - numbered);
+  const size_t width = std::to_string(largest).size();
 
-  for (const auto& path : opt.paths) {
-    if (!fs::exists(path)) {
-      printe("Path does not exist: %s\n", path.c_str());
-      return 1;
+  std::vector<char> stage(1 << 16);
+  size_t used = 0;
+  size_t line = first_line - 1;
+  size_t start = 0;
+  auto emit_line = [&](size_t end) {
+    if (used + width + 2 > stage.size() ||
+        (used && used + width + 2 + end - start > stage.size())) {
+      sink(stage.data(), used);
+      used = 0;
     }
-    if (!opt.ignore_gitignore) {
-      auto rules = read_gitignore(fs::path(path).parent_path().string());
-      gitignore_rules.insert(gitignore_rules.end(), rules.begin(), rules.end());
+    char* dst = stage.data() + used;
+    char* digit = dst + width;
+    size_t next = content[start] == '[' ? elision_next_line(
+                                              content.data() + start,
+                                              content.data() + end -
+                                                  (content[end - 1] == '\n'))
+                                        : 0;
+    if (next) {
+      line = next - 1;
+    } else {
+      for (size_t n = ++line; n; n /= 10)
+        *--digit = '0' + n % 10;
     }
-    if (opt.claude_xml && path == opt.paths[0]) {
-      fprintf(writer, "<documents>\n");
+    memset(dst, ' ', digit - dst);
+    dst[width] = ' ';
+    dst[width + 1] = ' ';
+    used += width + 2;
+    if (used + end - start > stage.size()) {
+      sink(stage.data(), used);
+      sink(content.data() + start, end - start);
+      used = 0;
+    } else {
+      memcpy(stage.data() + used, content.data() + start, end - start);
+      used += end - start;
     }
-    process_path(path, opt.extensions, opt.include_hidden, opt.ignore_gitignore,
-                 gitignore_rules, opt.ignore_patterns, writer, opt.claude_xml);
+    start = end;
+  };
+  scan_byte(content.data(), content.size(), '\n',
+            [&](size_t pos) { emit_line(pos + 1); });
+  if (line < lines)
+    emit_line(content.size());
+  sink(stage.data(), used);
+}
+
+// Fenced code block languages for -m, keyed by well-known file name or by
+// extension (with its leading dot).
+struct LanguageEntry {
+  const char* key;
+  const char* language;
+};
+
+constexpr LanguageEntry kLanguages[] = {
+    {".c", "c"},
+    {".h", "c"},
+    {".cc", "cpp"},
+    {".cpp", "cpp"},
+    {".cxx", "cpp"},
+    {".hh", "cpp"},
+    {".hpp", "cpp"},
+    {".hxx", "cpp"},
+    {".inl", "cpp"},
+    {".m", "objectivec"},
+    {".mm", "objectivec"},
+    {".cs", "csharp"},
+    {".java", "java"},
+    {".kt", "kotlin"},
+    {".kts", "kotlin"},
+    {".scala", "scala"},
+    {".go", "go"},
+    {".rs", "rust"},
+    {".swift", "swift"},
+    {".zig", "zig"},
+    {".py", "python"},
+    {".pyi", "python"},
+    {".rb", "ruby"},
+    {".pl", "perl"},
+    {".pm", "perl"},
+    {".php", "php"},
+    {".lua", "lua"},
+    {".r", "r"},
+    {".R", "r"},
+    {".jl", "julia"},
+    {".hs", "haskell"},
+    {".ml", "ocaml"},
+    {".ex", "elixir"},
+    {".exs", "elixir"},
+    {".erl", "erlang"},
+    {".clj", "clojure"},
+    {".dart", "dart"},
+    {".js", "javascript"},
+    {".mjs", "javascript"},
+    {".cjs", "javascript"},
+    {".jsx", "jsx"},
+    {".ts", "typescript"},
+    {".tsx", "tsx"},
+    {".vue", "vue"},
+    {".svelte", "svelte"},
+    {".html", "html"},
+    {".htm", "html"},
+    {".css", "css"},
+    {".scss", "scss"},
+    {".less", "less"},
+    {".xml", "xml"},
+    {".svg", "xml"},
+    {".json", "json"},
+    {".yaml", "yaml"},
+    {".yml", "yaml"},
+    {".toml", "toml"},
+    {".ini", "ini"},
+    {".cfg", "ini"},
+    {".md", "markdown"},
+    {".rst", "rst"},
+    {".tex", "latex"},
+    {".sql", "sql"},
+    {".proto", "protobuf"},
+    {".graphql", "graphql"},
+    {".sh", "bash"},
+    {".bash", "bash"},
+    {".zsh", "zsh"},
+    {".fish", "fish"},
+    {".ps1", "powershell"},
+    {".bat", "batch"},
+    {".cmake", "cmake"},
+    {".mk", "makefile"},
+    {".gradle", "groovy"},
+    {".tf", "hcl"},
+    {".nix", "nix"},
+    {".diff", "diff"},
+    {".patch", "diff"},
+    {"CMakeLists.txt", "cmake"},
+    {"Makefile", "makefile"},
+    {"GNUmakefile", "makefile"},
+    {"makefile", "makefile"},
+    {"Dockerfile", "dockerfile"},
+    {"Containerfile", "dockerfile"},
+    {"Gemfile", "ruby"},
+    {"Rakefile", "ruby"},
+    {"Jenkinsfile", "groovy"},
+    {"BUILD", "python"},
+    {"WORKSPACE", "python"},
+    {"meson.build", "meson"},
+};
+
+constexpr size_t kLanguageCount = sizeof(kLanguages) / sizeof(kLanguages[0]);
+constexpr size_t kLanguageSlots = 128;
+constexpr size_t kLanguageBuckets = 32;
+
+constexpr uint32_t language_hash(const char* key, size_t len, uint32_t seed) {
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ static_cast<unsigned char>(key[i])) * 16777619u;
+  }
+  return h ^ (h >> 15);
+}
+
+constexpr size_t const_strlen(const char* s) {
+  size_t n = 0;
+  while (s[n])
+    n++;
+  return n;
+}
+
+// Hash-and-displace perfect hash built at compile time: keys are grouped
+// into buckets by one hash, and each bucket, largest first, is given the
+// smallest seed that sends all of its keys to free slots. A lookup is then
+// two hashes and one string comparison.
+struct LanguageTable {
+  uint32_t seeds[kLanguageBuckets];
+  uint8_t slots[kLanguageSlots];
+};
+
+constexpr LanguageTable build_language_table() {
+  LanguageTable table = {};
+  size_t bucket_of[kLanguageCount] = {};
+  size_t bucket_size[kLanguageBuckets] = {};
+  for (size_t i = 0; i < kLanguageCount; i++) {
+    const char* key = kLanguages[i].key;
+    bucket_of[i] =
+        language_hash(key, const_strlen(key), 0) % kLanguageBuckets;
+    bucket_size[bucket_of[i]]++;
   }
-  if (opt.claude_xml) {
-    fprintf(writer, "</documents>\n");
+
+  bool done[kLanguageBuckets] = {};
+  for (size_t round = 0; round < kLanguageBuckets; round++) {
+    size_t bucket = 0;
+    for (size_t b = 0; b < kLanguageBuckets; b++) {
+      if (!done[b] && (done[bucket] || bucket_size[b] > bucket_size[bucket]))
+        bucket = b;
+    }
+    done[bucket] = true;
+
+    for (uint32_t seed = 1;; seed++) {
+      uint8_t trial[kLanguageSlots] = {};
+      bool fits = true;
+      for (size_t i = 0; i < kLanguageCount && fits; i++) {
+        if (bucket_of[i] != bucket)
+          continue;
+        const char* key = kLanguages[i].key;
+        size_t slot = language_hash(key, const_strlen(key), seed) %
+                      kLanguageSlots;
+        fits = !table.slots[slot] && !trial[slot];
+        trial[slot] = i + 1;
+      }
+      if (fits) {
+        for (size_t slot = 0; slot < kLanguageSlots; slot++) {
+          if (trial[slot])
+            table.slots[slot] = trial[slot];
+        }
+        table.seeds[bucket] = seed;
+        break;
+      }
+    }
   }
+  return table;
+}
 
-  return 0;
+constexpr LanguageTable kLanguageTable = build_language_table();
+static_assert(kLanguageCount < kLanguageSlots, "language table is full");
+
+static const char* lookup_language_key(const char* key, size_t len) {
+  uint32_t seed =
+      kLanguageTable.seeds[language_hash(key, len, 0) % kLanguageBuckets];
+  uint8_t index =
+      kLanguageTable.slots[language_hash(key, len, seed) % kLanguageSlots];
+  if (index == 0)
+    return nullptr;
+  const LanguageEntry& entry = kLanguages[index - 1];
+  return strlen(entry.key) == len && memcmp(entry.key, key, len) == 0
+             ? entry.language
+             : nullptr;
+}
+
+static const char* language_for_path(const std::string& path) {
+  size_t slash = path.find_last_of('/');
+  const char* name = path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+  size_t name_len = path.c_str() + path.size() - name;
+  if (const char* language = lookup_language_key(name, name_len))
+    return language;
+  const char* dot = strrchr(name, '.');
+  if (dot && dot != name) {
+    if (const char* language = lookup_language_key(dot, name + name_len - dot))
+      return language;
+  }
+  return "";
+}
+
+// Longest run of consecutive backticks, found with the same vectorized
+// byte scan used for line numbering.
+static size_t longest_backtick_run(const std::string& content) {
+  size_t longest = 0;
+  size_t run = 0;
+  size_t last = SIZE_MAX;
+  scan_byte(content.data(), content.size(), '`', [&](size_t pos) {
+    run = pos == last + 1 ? run + 1 : 1;
+    last = pos;
+    longest = std::max(longest, run);
+  });
+  return longest;
+}
+
+// Length of the valid UTF-8 sequence starting at p, or 0 if the bytes there
+// are not one (overlong forms, surrogates and values past U+10FFFF included).
+static size_t utf8_sequence_length(const unsigned char* p, size_t avail) {
+  unsigned char c = p[0];
+  if (c < 0x80)
+    return 1;
+  size_t len;
+  uint32_t min;
+  uint32_t cp;
+  if ((c & 0xe0) == 0xc0) {
+    len = 2;
+    min = 0x80;
+    cp = c & 0x1f;
+  } else if ((c & 0xf0) == 0xe0) {
+    len = 3;
+    min = 0x800;
+    cp = c & 0x0f;
+  } else if ((c & 0xf8) == 0xf0) {
+    len = 4;
+    min = 0x10000;
+    cp = c & 0x07;
+  } else {
+    return 0;
+  }
+  if (avail < len)
+    return 0;
+  for (size_t i = 1; i < len; i++) {
+    if ((p[i] & 0xc0) != 0x80)
+      return 0;
+    cp = (cp << 6) | (p[i] & 0x3f);
+  }
+  if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+    return 0;
+  return len;
+}
+
+// Writes data as the inside of a JSON string. Runs of bytes that need no
+// escaping are found 16 at a time with SSE2 and copied in bulk; control
+// characters, quotes and backslashes are escaped, and bytes that are not
+// valid UTF-8 become U+FFFD.
+static void write_json_string(FILE* writer, const char* data, size_t size) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  size_t i = 0;
+  size_t clean = 0;
+  auto flush = [&]() {
+    fwrite(data + clean, 1, i - clean, writer);
+  };
+  while (i < size) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(0x20);
+    while (i + 16 <= size) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+      // Signed compare: bytes >= 0x80 are negative, so this also flags
+      // non-ASCII bytes for the UTF-8 check below.
+      __m128i special = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                       _mm_cmpeq_epi8(chunk, backslash)),
+          _mm_cmplt_epi8(chunk, space));
+      unsigned mask = _mm_movemask_epi8(special);
+      if (mask) {
+        i += __builtin_ctz(mask);
+        break;
+      }
+      i += 16;
+    }
+#endif
+    while (i < size && p[i] >= 0x20 && p[i] < 0x80 && p[i] != '"' &&
+           p[i] != '\\') {
+      i++;
+    }
+    if (i == size)
+      break;
+
+    unsigned char c = p[i];
+    if (c >= 0x80) {
+      size_t len = utf8_sequence_length(p + i, size - i);
+      if (len) {
+        i += len;
+        continue;
+      }
+      flush();
+      fputs("\\ufffd", writer);
+    } else {
+      flush();
+      switch (c) {
+        case '"':
+          fputs("\\\"", writer);
+          break;
+        case '\\':
+          fputs("\\\\", writer);
+          break;
+        case '\n':
+          fputs("\\n", writer);
+          break;
+        case '\r':
+          fputs("\\r", writer);
+          break;
+        case '\t':
+          fputs("\\t", writer);
+          break;
+        case '\b':
+          fputs("\\b", writer);
+          break;
+        case '\f':
+          fputs("\\f", writer);
+          break;
+        default:
+          fprintf(writer, "\\u%04x", c);
+          break;
+      }
+    }
+    clean = ++i;
+  }
+  flush();
+}
+
+// Rough BPE token estimate: words cost one token per four characters,
+// while punctuation and other symbols cost one each. Whitespace is folded
+// into the following token.
+static size_t estimate_tokens(const std::string& content) {
+  size_t tokens = 0;
+  size_t word = 0;
+  for (unsigned char c : content) {
+    if (isalnum(c) || c >= 0x80 || c == '_') {
+      word++;
+      continue;
+    }
+    tokens += (word + 3) / 4;
+    word = 0;
+    if (!isspace(c))
+      tokens++;
+  }
+  return tokens + (word + 3) / 4;
+}
+
+// Output is handed to a dedicated writer thread through a pair of buffers:
+// producers append to the front buffer while the thread writes out the
+// back one, and the two are swapped whenever the thread is idle. This
+// keeps reading and formatting going while a slow consumer drains, and
+// batches small writes under load without delaying output when idle.
+// Producers block once more than max_lag bytes are waiting.
+class AsyncWriter {
+ public:
+  AsyncWriter(int fd, size_t max_lag)
+      : fd_(fd), max_lag_(max_lag), thread_(&AsyncWriter::run, this) {}
+
+  AsyncWriter(const AsyncWriter&) = delete;
+  AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+  ~AsyncWriter() { finish(); }
+
+  // A stdio stream whose buffered output feeds this writer, so all the
+  // formatting code can keep using fprintf/fwrite.
+  FILE* open_stream() {
+    cookie_io_functions_t io = {};
+    io.write = &AsyncWriter::cookie_write;
+    io.close = &AsyncWriter::cookie_close;
+    FILE* file = fopencookie(this, "w", io);
+    if (file)
+      setvbuf(file, nullptr, _IOFBF, 1 << 16);
+    return file;
+  }
+
+  // Drains everything queued and stops the thread.
+  void finish() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closing_)
+        return;
+      closing_ = true;
+    }
+    writer_cv_.notify_one();
+    thread_.join();
+  }
+
+ private:
+  static ssize_t cookie_write(void* cookie, const char* data, size_t size) {
+    return static_cast<AsyncWriter*>(cookie)->write(data, size);
+  }
+
+  static int cookie_close(void* cookie) {
+    AsyncWriter* writer = static_cast<AsyncWriter*>(cookie);
+    writer->finish();
+    return writer->failed_ ? -1 : 0;
+  }
+
+  ssize_t write(const char* data, size_t size) {
+    size_t done = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (done < size) {
+      producer_cv_.wait(lock, [&] {
+        return failed_ || front_.empty() ||
+               front_.size() + in_flight_ < max_lag_;
+      });
+      if (failed_)
+        return done ? done : -1;
+      size_t room = max_lag_ > front_.size() + in_flight_
+                        ? max_lag_ - front_.size() - in_flight_
+                        : max_lag_;
+      size_t len = std::min(size - done, room);
+      bool was_empty = front_.empty();
+      front_.append(data + done, len);
+      done += len;
+      if (was_empty)
+        writer_cv_.notify_one();
+    }
+    return done;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      writer_cv_.wait(lock, [&] { return closing_ || !front_.empty(); });
+      if (front_.empty())
+        break;
+      back_.swap(front_);
+      in_flight_ = back_.size();
+      lock.unlock();
+      producer_cv_.notify_all();
+
+      bool ok = true;
+      const char* p = back_.data();
+      size_t left = back_.size();
+      while (ok && left > 0) {
+        ssize_t n = ::write(fd_, p, left);
+        if (n < 0 && errno == EINTR)
+          continue;
+        ok = n > 0;
+        p += ok ? n : 0;
+        left -= ok ? n : 0;
+      }
+      back_.clear();
+
+      lock.lock();
+      in_flight_ = 0;
+      if (!ok) {
+        failed_ = true;
+        front_.clear();
+      }
+      producer_cv_.notify_all();
+    }
+  }
+
+  int fd_;
+  size_t max_lag_;
+  std::mutex mutex_;
+  std::condition_variable producer_cv_;
+  std::condition_variable writer_cv_;
+  std::string front_;
+  std::string back_;
+  size_t in_flight_ = 0;
+  bool closing_ = false;
+  bool failed_ = false;
+  std::thread thread_;
+};
+
+static const char* header_text(const Opt& opt) {
+  if (opt.format == FORMAT_XML)
+    return "<documents>\n";
+  return opt.format == FORMAT_JSON ? "[" : "";
+}
+
+static const char* footer_text(const Opt& opt) {
+  if (opt.format == FORMAT_XML)
+    return "</documents>\n";
+  return opt.format == FORMAT_JSON ? "\n]\n" : "";
+}
+
+class OutputSplitter;
+// Set while the output is split into parts (--split-tokens/--split-bytes).
+// Each part then carries its own header and footer.
+static OutputSplitter* output_splitter = nullptr;
+
+static void print_header(FILE* writer, const Opt& opt) {
+  if (!output_splitter)
+    fputs(header_text(opt), writer);
+}
+
+static void print_footer(FILE* writer, const Opt& opt) {
+  if (!output_splitter)
+    fputs(footer_text(opt), writer);
+}
+
+// Index of the next document; reset for every --serve request.
+static int global_index = 1;
+
+// A piece of a file printed as a document of its own with --chunk-bytes:
+// bytes [begin, end) of the content, lines first_line to last_line.
+struct Chunk {
+  size_t begin;
+  size_t end;
+  size_t first_line;
+  size_t last_line;
+};
+
+// Writes one document as document number `index` of its output, or only
+// the lines of `chunk` if it is set, `content` then holding just those.
+// mtime is the modification time in seconds since the epoch, or -1 when
+// the source has none; only the JSON formats report it.
+static void print_document(FILE* writer,
+                           const std::string& path,
+                           const std::string& content,
+                           const Opt& opt,
+                           int64_t mtime,
+                           int index,
+                           const Chunk* chunk) {
+  size_t first_line = chunk ? chunk->first_line : 1;
+  auto write_raw = [&](const char* data, size_t size) {
+    fwrite(data, 1, size, writer);
+  };
+  auto write_escaped = [&](const char* data, size_t size) {
+    write_json_string(writer, data, size);
+  };
+  auto write_body = [&]() {
+    bool json = opt.format == FORMAT_JSON || opt.format == FORMAT_JSONL;
+    if (opt.line_numbers && json)
+      write_numbered(content, write_escaped, first_line);
+    else if (opt.line_numbers)
+      write_numbered(content, write_raw, first_line);
+    else if (json)
+      write_escaped(content.data(), content.size());
+    else
+      write_raw(content.data(), content.size());
+  };
+  if (opt.format == FORMAT_JSON || opt.format == FORMAT_JSONL) {
+    if (opt.format == FORMAT_JSON)
+      fprintf(writer, index > 1 ? ",\n" : "\n");
+    fprintf(writer, "{\"path\":\"");
+    write_json_string(writer, path.data(), path.size());
+    fprintf(writer, "\",\"size\":%zu", content.size());
+    if (chunk)
+      fprintf(writer, ",\"lines\":[%zu,%zu]", chunk->first_line,
+              chunk->last_line);
+    if (mtime >= 0)
+      fprintf(writer, ",\"mtime\":%lld", static_cast<long long>(mtime));
+    if (opt.count_tokens)
+      fprintf(writer, ",\"tokens\":%zu", estimate_tokens(content));
+    fprintf(writer, ",\"content\":\"");
+    write_body();
+    fprintf(writer, "\"}");
+    if (opt.format == FORMAT_JSONL) {
+      fprintf(writer, "\n");
+      fflush(writer);
+    }
+  } else if (opt.format == FORMAT_XML) {
+    fprintf(writer, "<document index=\"%d\">\n", index);
+    fprintf(writer, "<source>%s</source>\n", path.c_str());
+    if (chunk)
+      fprintf(writer, "<lines>%zu-%zu</lines>\n", chunk->first_line,
+              chunk->last_line);
+    fprintf(writer, "<document_content>\n");
+    write_body();
+    fprintf(writer, "\n</document_content>\n");
+    fprintf(writer, "</document>\n");
+  } else if (opt.format == FORMAT_MARKDOWN) {
+    std::string fence(std::max<size_t>(3, longest_backtick_run(content) + 1),
+                      '`');
+    fprintf(writer, "%s", path.c_str());
+    if (chunk)
+      fprintf(writer, ":%zu-%zu", chunk->first_line, chunk->last_line);
+    fprintf(writer, "\n%s%s\n", fence.c_str(), language_for_path(path));
+    write_body();
+    fprintf(writer, "\n%s\n", fence.c_str());
+  } else {
+    fprintf(writer, "%s", path.c_str());
+    if (chunk)
+      fprintf(writer, ":%zu-%zu", chunk->first_line, chunk->last_line);
+    fprintf(writer, "\n---\n");
+    write_body();
+    fprintf(writer, "\n---\n");
+  }
+}
+
+// Spreads the documents over numbered output files for --split-tokens and
+// --split-bytes. Each part is a complete output of its own, with header
+// and footer, and holds at most the given number of estimated tokens and
+// bytes. Documents are never split: one over the limit gets a part to
+// itself. Every part has its own writer, so a finished part drains while
+// the next one fills.
+class OutputSplitter {
+ public:
+  explicit OutputSplitter(const Opt& opt) : opt_(opt) {
+    std::string frame = std::string(header_text(opt)) + footer_text(opt);
+    frame_tokens_ = estimate_tokens(frame);
+    frame_bytes_ = frame.size();
+  }
+
+  OutputSplitter(const OutputSplitter&) = delete;
+  OutputSplitter& operator=(const OutputSplitter&) = delete;
+
+  void add(const std::string& path,
+           const std::string& content,
+           int64_t mtime,
+           const Chunk* chunk) {
+    std::string doc = format(path, content, mtime, chunk);
+    uint64_t tokens = opt_.split_tokens ? estimate_tokens(doc) : 0;
+    if (part_ && !fits(tokens, doc.size())) {
+      // Numbered afresh as the first document of the next part.
+      close_part();
+      open_part();
+      doc = format(path, content, mtime, chunk);
+      tokens = opt_.split_tokens ? estimate_tokens(doc) : 0;
+    } else if (!part_) {
+      open_part();
+    }
+    if (part_->writer)
+      fwrite(doc.data(), 1, doc.size(), part_->writer);
+    tokens_ += tokens;
+    bytes_ += doc.size();
+    documents_++;
+  }
+
+  // Closes the last part, or writes an empty first part if there were no
+  // documents at all. Returns whether every part could be written.
+  bool finish() {
+    if (!part_ && number_ == 0)
+      open_part();
+    if (part_)
+      close_part();
+    previous_.reset();
+    return !failed_;
+  }
+
+ private:
+  struct Part {
+    FILE_ptr file;
+    // Declared after file so the stream is drained before it is closed.
+    std::unique_ptr<AsyncWriter> async_writer;
+    FILE_ptr async_out;
+    FILE* writer = nullptr;
+  };
+
+  std::string format(const std::string& path,
+                     const std::string& content,
+                     int64_t mtime,
+                     const Chunk* chunk) {
+    char* data = nullptr;
+    size_t size = 0;
+    FILE* mem = open_memstream(&data, &size);
+    if (!mem)
+      return std::string();
+    print_document(mem, path, content, opt_, mtime, documents_ + 1, chunk);
+    fclose(mem);
+    std::string doc(data, size);
+    free(data);
+    return doc;
+  }
+
+  bool fits(uint64_t tokens, uint64_t bytes) const {
+    return (!opt_.split_tokens || tokens_ + tokens <= opt_.split_tokens) &&
+           (!opt_.split_bytes || bytes_ + bytes <= opt_.split_bytes);
+  }
+
+  void open_part() {
+    part_.reset(new Part);
+    number_++;
+    std::vector<char> name(opt_.output_file.size() + 32);
+    snprintf(name.data(), name.size(), opt_.output_file.c_str(), number_);
+    part_->file.reset(fopen(resolve_path(name.data()).c_str(), "w"));
+    part_->writer = part_->file.get();
+    if (!part_->writer) {
+      printe("Cannot open output file %s: %s\n", name.data(), strerror(errno));
+      failed_ = true;
+    } else if (opt_.max_output_lag) {
+      part_->async_writer.reset(
+          new AsyncWriter(fileno(part_->writer), opt_.max_output_lag));
+      part_->async_out.reset(part_->async_writer->open_stream());
+      if (part_->async_out)
+        part_->writer = part_->async_out.get();
+    }
+    if (part_->writer)
+      fputs(header_text(opt_), part_->writer);
+    tokens_ = frame_tokens_;
+    bytes_ = frame_bytes_;
+    documents_ = 0;
+  }
+
+  // Hands the part's remaining output to its writer thread without
+  // waiting for it; only the part before it is waited for.
+  void close_part() {
+    if (part_->writer) {
+      fputs(footer_text(opt_), part_->writer);
+      if (fflush(part_->writer) != 0)
+        failed_ = true;
+    }
+    previous_ = std::move(part_);
+  }
+
+  const Opt& opt_;
+  uint64_t frame_tokens_ = 0;
+  uint64_t frame_bytes_ = 0;
+  uint64_t tokens_ = 0;
+  uint64_t bytes_ = 0;
+  int documents_ = 0;
+  int number_ = 0;
+  bool failed_ = false;
+  std::unique_ptr<Part> part_;
+  std::unique_ptr<Part> previous_;
+};
+
+static void print_path(FILE* writer,
+                       const std::string& path,
+                       const std::string& content,
+                       const Opt& opt,
+                       int64_t mtime = -1,
+                       const Chunk* chunk = nullptr) {
+  if (output_splitter)
+    output_splitter->add(path, content, mtime, chunk);
+  else
+    print_document(writer, path, content, opt, mtime, global_index, chunk);
+  global_index++;
+}
+
+// Length of the longest valid UTF-8 prefix of data. ASCII is skipped 16
+// bytes at a time with SSE2, so typical source text is validated at
+// memory speed; only non-ASCII sequences are decoded one by one.
+static size_t utf8_valid_prefix(const char* data, size_t size) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  size_t i = 0;
+  while (i < size) {
+#if defined(__SSE2__)
+    while (i + 16 <= size &&
+           !_mm_movemask_epi8(
+               _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)))) {
+      i += 16;
+    }
+#endif
+    if (i == size)
+      break;
+    if (p[i] < 0x80) {
+      i++;
+      continue;
+    }
+    size_t len = utf8_sequence_length(p + i, size - i);
+    if (!len)
+      return i;
+    i += len;
+  }
+  return size;
+}
+
+static void append_utf8(std::string& out, uint32_t cp) {
+  if (cp < 0x80) {
+    out += static_cast<char>(cp);
+  } else if (cp < 0x800) {
+    out += static_cast<char>(0xc0 | (cp >> 6));
+    out += static_cast<char>(0x80 | (cp & 0x3f));
+  } else if (cp < 0x10000) {
+    out += static_cast<char>(0xe0 | (cp >> 12));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (cp & 0x3f));
+  } else {
+    out += static_cast<char>(0xf0 | (cp >> 18));
+    out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (cp & 0x3f));
+  }
+}
+
+static const char kReplacementChar[] = "\xef\xbf\xbd";
+
+// Copies valid spans in bulk and replaces each invalid byte with U+FFFD.
+static void replace_invalid_utf8(const std::string& in,
+                                 size_t valid,
+                                 std::string& out) {
+  out.reserve(in.size() + 16);
+  out.assign(in, 0, valid);
+  size_t i = valid;
+  while (i < in.size()) {
+    out += kReplacementChar;
+    i++;
+    size_t len = utf8_valid_prefix(in.data() + i, in.size() - i);
+    out.append(in, i, len);
+    i += len;
+  }
+}
+
+static void decode_latin1(const std::string& in, size_t start,
+                          std::string& out) {
+  out.reserve(in.size() + in.size() / 8);
+  out.assign(in, 0, start);
+  for (size_t i = start; i < in.size(); i++) {
+    append_utf8(out, static_cast<unsigned char>(in[i]));
+  }
+}
+
+static void decode_utf16(const std::string& in,
+                         size_t start,
+                         bool big_endian,
+                         std::string& out) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(in.data());
+  auto unit = [&](size_t i) -> uint32_t {
+    return big_endian ? (p[i] << 8) | p[i + 1] : p[i] | (p[i + 1] << 8);
+  };
+  out.clear();
+  out.reserve(in.size());
+  size_t i = start;
+  for (; i + 2 <= in.size(); i += 2) {
+    uint32_t cp = unit(i);
+    if (cp >= 0xd800 && cp < 0xdc00 && i + 4 <= in.size()) {
+      uint32_t low = unit(i + 2);
+      if (low >= 0xdc00 && low < 0xe000) {
+        append_utf8(out, 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00));
+        i += 2;
+        continue;
+      }
+    }
+    if (cp >= 0xd800 && cp < 0xe000)
+      out += kReplacementChar;
+    else
+      append_utf8(out, cp);
+  }
+  if (i < in.size())
+    out += kReplacementChar;
+}
+
+// Recognises BOM-less UTF-16 by its pattern of zero bytes: mostly-ASCII
+// text has a zero in most high bytes and almost none in the low bytes.
+static int guess_utf16(const std::string& content) {
+  size_t n = std::min<size_t>(content.size(), 4096) & ~size_t(1);
+  if (n < 4)
+    return 0;
+  size_t even = 0, odd = 0;
+  for (size_t i = 0; i < n; i += 2) {
+    even += content[i] == 0;
+    odd += content[i + 1] == 0;
+  }
+  size_t pairs = n / 2;
+  if (odd * 2 > pairs && even * 4 < odd)
+    return 'L';
+  if (even * 2 > pairs && odd * 4 < even)
+    return 'B';
+  return 0;
+}
+
+static bool has_utf16_bom(const std::string& content) {
+  const unsigned char* p =
+      reinterpret_cast<const unsigned char*>(content.data());
+  return content.size() >= 2 &&
+         ((p[0] == 0xff && p[1] == 0xfe) || (p[0] == 0xfe && p[1] == 0xff));
+}
+
+static bool has_utf8_bom(const std::string& content) {
+  return content.compare(0, 3, "\xef\xbb\xbf") == 0;
+}
+
+// Whether content (or its first few KB) is UTF-16, by BOM or by its
+// zero-byte pattern.
+static bool is_utf16(const std::string& content) {
+  return has_utf16_bom(content) ||
+         (!has_utf8_bom(content) && guess_utf16(content));
+}
+
+// Transcodes UTF-16 content to UTF-8; returns false if it is not UTF-16.
+static bool decode_if_utf16(std::string& content) {
+  if (!is_utf16(content))
+    return false;
+  std::string out;
+  if (has_utf16_bom(content))
+    decode_utf16(content, 2, content[0] == '\xfe', out);
+  else
+    decode_utf16(content, 0, guess_utf16(content) == 'B', out);
+  content.swap(out);
+  return true;
+}
+
+// Whether data holds at least one valid multibyte UTF-8 sequence.
+static bool has_utf8_multibyte(const std::string& content) {
+  const unsigned char* p =
+      reinterpret_cast<const unsigned char*>(content.data());
+  for (size_t i = 0; i < content.size(); i++) {
+    if (p[i] >= 0xc0 && utf8_sequence_length(p + i, content.size() - i))
+      return true;
+  }
+  return false;
+}
+
+// Encoding stage: strips a UTF-8 BOM, transcodes UTF-16 and handles
+// invalid UTF-8 according to --invalid-encoding. Returns false if the file
+// should be skipped.
+static bool normalize_encoding(const std::string& path,
+                               std::string& content,
+                               const Opt& opt) {
+  if (opt.invalid_encoding == ENCODING_KEEP || decode_if_utf16(content))
+    return true;
+  if (has_utf8_bom(content))
+    content.erase(0, 3);
+
+  std::string out;
+  size_t valid = utf8_valid_prefix(content.data(), content.size());
+  if (valid == content.size())
+    return true;
+
+  EncodingPolicy policy = opt.invalid_encoding;
+  if (policy == ENCODING_AUTO) {
+    // Text without a single valid multibyte sequence is most likely a
+    // legacy 8-bit encoding. UTF-8 with a few bad bytes, and data with NUL
+    // bytes, which is binary, only get the bad bytes replaced.
+    bool binary = memchr(content.data(), '\0', content.size());
+    policy = binary || has_utf8_multibyte(content) ? ENCODING_REPLACE
+                                                   : ENCODING_LATIN1;
+  }
+  switch (policy) {
+    case ENCODING_LATIN1:
+      decode_latin1(content, valid, out);
+      break;
+    case ENCODING_SKIP:
+      printe("Warning: Skipping file %s due to invalid UTF-8\n", path.c_str());
+      return false;
+    default:
+      replace_invalid_utf8(content, valid, out);
+      break;
+  }
+  content.swap(out);
+  return true;
+}
+
+// Keeps at most max_bytes/max_lines of a file, from its head, its tail or
+// both, and reports the rest with a marker. Only the kept ranges are read:
+// read_at(offset, length, dst) fetches bytes from the source, so a file
+// source costs one pread per chunk actually emitted.
+template <typename ReadAt>
+static bool read_capped(uint64_t size,
+                        const Opt& opt,
+                        ReadAt read_at,
+                        std::string& out) {
+  uint64_t max_bytes = opt.max_file_bytes ? opt.max_file_bytes : UINT64_MAX;
+  uint64_t max_lines = opt.max_file_lines ? opt.max_file_lines : UINT64_MAX;
+  // A byte cap the file fits in does not bind. Then head and tail share
+  // out just the line cap, and if the file is within that too they meet
+  // and the file is kept whole.
+  if (size <= max_bytes)
+    max_bytes = UINT64_MAX;
+  uint64_t head_bytes = max_bytes, head_lines = max_lines;
+  uint64_t tail_bytes = 0, tail_lines = 0;
+  if (opt.truncate == TRUNCATE_TAIL) {
+    std::swap(head_bytes, tail_bytes);
+    std::swap(head_lines, tail_lines);
+  } else if (opt.truncate == TRUNCATE_HEAD_TAIL) {
+    head_bytes = max_bytes / 2 + max_bytes % 2;
+    tail_bytes = max_bytes / 2;
+    head_lines = max_lines / 2 + max_lines % 2;
+    tail_lines = max_lines / 2;
+  }
+
+  const size_t chunk = 1 << 16;
+  std::string head;
+  uint64_t lines = 0;
+  while (head.size() < size && head.size() < head_bytes &&
+         lines < head_lines) {
+    size_t offset = head.size();
+    size_t len = std::min<uint64_t>({chunk, size - offset, head_bytes - offset});
+    head.resize(offset + len);
+    if (!read_at(offset, len, &head[offset]))
+      return false;
+    for (size_t i = offset; i < offset + len; i++) {
+      if (head[i] == '\n' && ++lines == head_lines) {
+        head.resize(i + 1);
+        break;
+      }
+    }
+  }
+  if (head.size() == size) {
+    out.swap(head);
+    return true;
+  }
+
+  // Walk back from the end a block at a time; a trailing newline does not
+  // start a line. Blocks are joined once the start of the tail is found.
+  std::vector<std::string> blocks;
+  uint64_t tail_start = size;
+  lines = 0;
+  bool skip_final_newline = true;
+  while (tail_start > head.size() && size - tail_start < tail_bytes &&
+         lines < tail_lines) {
+    size_t len = std::min<uint64_t>(
+        {chunk, tail_start - head.size(), tail_bytes - (size - tail_start)});
+    std::string block(len, '\0');
+    if (!read_at(tail_start - len, len, &block[0]))
+      return false;
+    size_t keep = 0;
+    for (size_t i = len; i-- > 0;) {
+      if (block[i] == '\n' && !(skip_final_newline && i == len - 1 &&
+                                tail_start == size) &&
+          ++lines == tail_lines) {
+        keep = i + 1;
+        break;
+      }
+    }
+    skip_final_newline = false;
+    block.erase(0, keep);
+    tail_start -= block.size();
+    blocks.push_back(std::move(block));
+    if (keep)
+      break;
+  }
+  std::string tail;
+  tail.reserve(size - tail_start);
+  for (auto it = blocks.rbegin(); it != blocks.rend(); ++it)
+    tail += *it;
+
+  if (head.size() + tail.size() == size) {
+    out.swap(head);
+    out += tail;
+    return true;
+  }
+
+  // Never split a UTF-8 sequence at either cut: drop a lead byte whose
+  // sequence is not complete before the cut.
+  size_t lead = head.size();
+  while (lead > 0 && head.size() - lead < 3 &&
+         (head[lead - 1] & 0xc0) == 0x80)
+    lead--;
+  if (lead > 0 && (head[lead - 1] & 0xc0) == 0xc0) {
+    unsigned char c = head[lead - 1];
+    size_t length = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+    if (head.size() - (lead - 1) < length)
+      head.resize(lead - 1);
+  }
+  size_t skip = 0;
+  while (skip < tail.size() && (tail[skip] & 0xc0) == 0x80)
+    skip++;
+  tail.erase(0, skip);
+
+  // With -n the marker names the number of the first tail line, which
+  // takes counting the newlines in the elided range.
+  uint64_t elided = size - head.size() - tail.size();
+  uint64_t next_line = 0;
+  if (opt.line_numbers) {
+    next_line = count_byte(head.data(), head.size(), '\n') + 1;
+    std::string block;
+    for (uint64_t offset = head.size(); offset < size - tail.size();) {
+      size_t len = std::min<uint64_t>(chunk, size - tail.size() - offset);
+      block.resize(len);
+      if (!read_at(offset, len, &block[0]))
+        return false;
+      next_line += count_byte(block.data(), len, '\n');
+      offset += len;
+    }
+  }
+  out.swap(head);
+  if (!out.empty() && out.back() != '\n')
+    out += '\n';
+  out += elision_marker(elided, next_line);
+  out += tail;
+  return true;
+}
+
+static bool has_content_caps(const Opt& opt) {
+  return opt.max_file_bytes || opt.max_file_lines;
+}
+
+// Whether the caps are applied as files are read. --grep/--grep-not have
+// to see whole files, so with them the caps wait until after filtering.
+static bool caps_on_read(const Opt& opt) {
+  return has_content_caps(opt) && !opt.grep;
+}
+
+// Applies --max-file-bytes/--max-file-lines to content that is already in
+// memory. UTF-16 is transcoded first, so the cuts fall between characters
+// and the marker is readable.
+static void apply_content_caps(std::string& content, const Opt& opt) {
+  if (!has_content_caps(opt))
+    return;
+  if (opt.invalid_encoding != ENCODING_KEEP)
+    decode_if_utf16(content);
+  std::string capped;
+  read_capped(content.size(), opt,
+              [&](uint64_t offset, size_t len, char* dst) {
+                memcpy(dst, content.data() + offset, len);
+                return true;
+              },
+              capped);
+  content.swap(capped);
+}
+
+// Caps content read into memory in one piece, such as archive members and
+// git blobs, unless the caps wait for --grep.
+static void cap_content(std::string& content, const Opt& opt) {
+  if (caps_on_read(opt))
+    apply_content_caps(content, opt);
+}
+
+static bool pread_fully(int fd, char* dst, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = pread(fd, dst, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    dst += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+// Reads an open file whose size is known, applying the content caps.
+static bool read_fd_content(int fd,
+                            uint64_t size,
+                            const std::string& path,
+                            const Opt& opt,
+                            std::string& content) {
+  bool ok;
+  std::string sniff;
+  if (caps_on_read(opt) && opt.invalid_encoding != ENCODING_KEEP) {
+    sniff.resize(std::min<uint64_t>(size, 4096));
+    if (!pread_fully(fd, &sniff[0], sniff.size(), 0))
+      sniff.clear();
+  }
+  if (caps_on_read(opt) && is_utf16(sniff)) {
+    // UTF-16 can only be cut once it is transcoded, so it is read whole.
+    content.resize(size);
+    ok = pread_fully(fd, &content[0], content.size(), 0);
+    if (ok)
+      apply_content_caps(content, opt);
+  } else if (caps_on_read(opt)) {
+    // Capped reads jump to the tail, so only hint whole-file reads.
+    ok = read_capped(size, opt,
+                     [&](uint64_t offset, size_t len, char* dst) {
+                       return pread_fully(fd, dst, len, offset);
+                     },
+                     content);
+  } else {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    content.resize(size);
+    ok = pread_fully(fd, &content[0], content.size(), 0);
+  }
+  if (!ok) {
+    printe("Warning: Skipping file %s due to error reading file\n",
+           path.c_str());
+    content.clear();
+  }
+  return ok;
+}
+
+// Reads `name` relative to `dir_fd`; `path` is only used for messages.
+static std::string read_file_content_at(int dir_fd,
+                                        const char* name,
+                                        const std::string& path,
+                                        const Opt& opt,
+                                        int64_t* mtime) {
+  int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    printe("Warning: Skipping file %s due to error opening file\n",
+           path.c_str());
+    return "";
+  }
+  if (mtime) {
+    *mtime = st.st_mtime;
+  }
+
+  std::string content;
+  read_fd_content(fd, st.st_size, path, opt, content);
+  close(fd);
+  return content;
+}
+
+static std::string read_file_content(const std::string& path,
+                                     const Opt& opt,
+                                     int64_t* mtime = nullptr) {
+  return read_file_content_at(AT_FDCWD, resolve_path(path).c_str(), path, opt,
+                              mtime);
+}
+
+// Asks the kernel to start reading a file that will be needed soon, so a
+// cold cache has several reads in flight instead of one at a time.
+static void prefetch_file(int dir_fd, const char* name, const Opt& opt) {
+  int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd < 0)
+    return;
+  uint64_t len = 0;
+  if (opt.max_file_bytes && opt.truncate == TRUNCATE_HEAD)
+    len = opt.max_file_bytes;
+  posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+  close(fd);
+}
+
+static bool should_ignore_file(const char* filename,
+                               const GlobSet* ignore_globs,
+                               const std::vector<std::string>& extensions,
+                               bool include_hidden) {
+  if (!include_hidden && filename[0] == '.') {
+    return true;
+  }
+
+  if (ignore_globs && ignore_globs->matches(filename)) {
+    return true;
+  }
+
+  if (!extensions.empty()) {
+    std::string_view name(filename);
+    for (const auto& ext : extensions) {
+      if (name.size() >= ext.size() &&
+          name.compare(name.size() - ext.size(), ext.size(), ext) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  return false;
+}
+
+// Comment syntax and literal forms the minifier needs to know about to
+// tell comments from string contents.
+struct LexerSyntax {
+  bool slash_comments;   // // and /* */
+  bool nested_blocks;    // /* /* */ */ (Rust)
+  bool hash_comments;    // # to end of line
+  bool hash_word_start;  // # only starts a comment at a word boundary
+  bool backtick_strings;  // `raw` (Go) or `template` (JS)
+  bool triple_quotes;    // ''' and """ (Python)
+  bool rust_chars;       // 'a' is a char, 'a alone a lifetime
+  bool regex_literals;   // /re/ after an operator (JS)
+  bool digit_separators;  // 1'000 (C++)
+};
+
+static const LexerSyntax* syntax_for_path(const std::string& path) {
+  static const LexerSyntax c_like = {true,  false, false, false, false,
+                                     false, false, false, true};
+  static const LexerSyntax go = {true,  false, false, false, true,
+                                 false, false, false, false};
+  static const LexerSyntax rust = {true,  true, false, false, false,
+                                   false, true, false, false};
+  static const LexerSyntax js = {true,  false, false, false, true,
+                                 false, false, true,  false};
+  static const LexerSyntax python = {false, false, true,  false, false,
+                                     true,  false, false, false};
+  static const LexerSyntax shell = {false, false, true,  true,  false,
+                                    false, false, false, false};
+  static const struct {
+    const char* language;
+    const LexerSyntax* syntax;
+  } languages[] = {
+      {"c", &c_like},          {"cpp", &c_like},
+      {"objectivec", &c_like}, {"csharp", &c_like},
+      {"java", &c_like},       {"kotlin", &c_like},
+      {"scala", &c_like},      {"swift", &c_like},
+      {"dart", &c_like},       {"protobuf", &c_like},
+      {"css", &c_like},        {"go", &go},
+      {"rust", &rust},         {"javascript", &js},
+      {"jsx", &js},            {"typescript", &js},
+      {"tsx", &js},            {"python", &python},
+      {"bash", &shell},        {"zsh", &shell},
+      {"fish", &shell},        {"cmake", &shell},
+      {"makefile", &shell},    {"dockerfile", &shell},
+  };
+  const char* language = language_for_path(path);
+  for (const auto& entry : languages) {
+    if (!strcmp(entry.language, language))
+      return entry.syntax;
+  }
+  return nullptr;
+}
+
+// Streaming comment stripper and whitespace collapser. feed() may be called
+// with arbitrary chunks: all lexer state lives in members, so a token split
+// across chunks is handled like any other. Output is appended to a string
+// the caller owns, and the only per-line state is a reused whitespace
+// buffer, so nothing is allocated per line.
+class Minifier {
+ public:
+  Minifier(const LexerSyntax* syntax,
+           bool strip_comments,
+           bool collapse_whitespace,
+           std::string& out)
+      : syntax_(syntax),
+        strip_(strip_comments && syntax),
+        collapse_(collapse_whitespace),
+        out_(out) {
+    for (unsigned char c : std::string("\r\f\v\n/#\"'`")) {
+      special_[c] = true;
+      special_in_line_[c] = true;
+    }
+    special_[' '] = true;
+    special_['\t'] = true;
+  }
+
+  void feed(const char* data, size_t size) {
+    const char* end = data + size;
+    while (data < end) {
+      // Fast paths: copy runs of ordinary code or string bytes and skip
+      // stripped line comments in bulk; everything else goes through step().
+      if (state_ == CODE) {
+        // Once a line has code, blanks cannot affect whether it is kept and
+        // may be copied along with it.
+        const bool* special = line_has_code_ ? special_in_line_ : special_;
+        const char* run = data;
+        while (run < end && !special[static_cast<unsigned char>(*run)])
+          run++;
+        if (run > data) {
+          out_ += pending_ws_;
+          pending_ws_.clear();
+          out_.append(data, run - data);
+          line_has_code_ = true;
+          prev_ = prev_code_ = run[-1];
+          first_byte_ = false;
+          data = run;
+          continue;
+        }
+      } else if (state_ == STRING && quote_ != '`') {
+        const char* run = data;
+        while (run < end && *run != quote_ && *run != '\\' && *run != '\n')
+          run++;
+        if (run > data) {
+          out_ += pending_ws_;
+          pending_ws_.clear();
+          out_.append(data, run - data);
+          data = run;
+          continue;
+        }
+      } else if (state_ == LINE_COMMENT && strip_) {
+        const char* eol =
+            static_cast<const char*>(memchr(data, '\n', end - data));
+        line_had_comment_ = true;
+        if (!eol) {
+          data = end;
+          continue;
+        }
+        data = eol;
+      }
+      if (syntax_)
+        step(*data);
+      else
+        code_char(*data);
+      data++;
+    }
+  }
+
+  void finish() {
+    if (state_ == SLASH)
+      code('/');
+    if (state_ == HASH_FIRST && !strip_)
+      code('#');
+    if (state_ == QUOTE_PAIR && quote_run_ == 2)
+      code(quote_);
+    out_ += pending_ws_;
+    pending_ws_.clear();
+  }
+
+ private:
+  enum State {
+    CODE,
+    SLASH,
+    HASH_FIRST,
+    KEEP_LINE,
+    LINE_COMMENT,
+    BLOCK_COMMENT,
+    BLOCK_STAR,
+    BLOCK_SLASH,
+    STRING,
+    STRING_ESCAPE,
+    QUOTE_PAIR,
+    TRIPLE_STRING,
+    TRIPLE_ESCAPE,
+    RUST_QUOTE,
+    RUST_QUOTE_CHAR,
+    REGEX,
+    REGEX_ESCAPE,
+    REGEX_CLASS,
+  };
+
+  void code(char c) {
+    out_ += pending_ws_;
+    pending_ws_.clear();
+    out_ += c;
+    line_has_code_ = true;
+  }
+
+  void whitespace(char c) { pending_ws_ += c; }
+
+  // Ends a line: drops lines left empty by stripped comments, trailing
+  // whitespace (when collapsing or after a stripped comment) and repeated
+  // blank lines (when collapsing).
+  void newline() {
+    if (line_has_code_) {
+      if (!collapse_ && !line_had_comment_) {
+        out_ += pending_ws_;
+      } else {
+        // Bulk-copied runs may have carried trailing blanks into out_.
+        while (!out_.empty() && (out_.back() == ' ' || out_.back() == '\t'))
+          out_.pop_back();
+      }
+      out_ += '\n';
+      blank_lines_ = 0;
+      at_start_ = false;
+    } else if (!line_had_comment_ &&
+               !(collapse_ && (blank_lines_ > 0 || at_start_))) {
+      if (!collapse_)
+        out_ += pending_ws_;
+      out_ += '\n';
+      blank_lines_++;
+    }
+    pending_ws_.clear();
+    line_has_code_ = false;
+    line_had_comment_ = false;
+  }
+
+  void code_char(char c) {
+    if (c == '\n') {
+      newline();
+    } else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' ||
+               c == '\v') {
+      whitespace(c);
+    } else {
+      code(c);
+      prev_code_ = c;
+    }
+    prev_ = c;
+  }
+
+  // Characters of a string literal are copied verbatim, newlines included.
+  void literal(char c) {
+    if (c == '\n') {
+      out_ += pending_ws_;
+      pending_ws_.clear();
+      out_ += '\n';
+      line_has_code_ = true;
+      blank_lines_ = 0;
+    } else {
+      code(c);
+    }
+  }
+
+  void comment(char c) {
+    if (!strip_) {
+      code_char(c);
+    } else if (c == '\n') {
+      newline();
+    } else {
+      line_had_comment_ = true;
+    }
+  }
+
+  bool regex_allowed() const {
+    return prev_code_ == '\0' || strchr("(,=:[!&|?{};+-*%<>~^", prev_code_);
+  }
+
+  void step(char c) {
+    switch (state_) {
+      case CODE:
+        if (c == '/' && syntax_->slash_comments) {
+          state_ = SLASH;
+        } else if (c == '#' && syntax_->hash_comments &&
+                   !(syntax_->hash_word_start && prev_ != '\0' &&
+                     !isspace(static_cast<unsigned char>(prev_)) &&
+                     !strchr(";|&(", prev_))) {
+          state_ = first_byte_ ? HASH_FIRST : LINE_COMMENT;
+          if (state_ == LINE_COMMENT)
+            comment(c);
+        } else if (c == '"' || (c == '`' && syntax_->backtick_strings)) {
+          quote_ = c;
+          code_char(c);
+          state_ = syntax_->triple_quotes ? QUOTE_PAIR : STRING;
+          quote_run_ = 1;
+        } else if (c == '\'') {
+          quote_ = c;
+          if (syntax_->digit_separators &&
+              isdigit(static_cast<unsigned char>(prev_))) {
+            code_char(c);
+          } else if (syntax_->rust_chars) {
+            code_char(c);
+            state_ = RUST_QUOTE;
+          } else {
+            code_char(c);
+            state_ = syntax_->triple_quotes ? QUOTE_PAIR : STRING;
+            quote_run_ = 1;
+          }
+        } else {
+          code_char(c);
+        }
+        break;
+
+      case SLASH:
+        if (c == '/') {
+          state_ = LINE_COMMENT;
+          comment('/');
+          comment(c);
+        } else if (c == '*') {
+          state_ = BLOCK_COMMENT;
+          depth_ = 1;
+          comment('/');
+          comment(c);
+        } else if (syntax_->regex_literals && regex_allowed()) {
+          code_char('/');
+          state_ = REGEX;
+          step_regex(c);
+        } else {
+          code_char('/');
+          state_ = CODE;
+          step(c);
+        }
+        break;
+
+      case HASH_FIRST:
+        // A #! line at the very start of a script is kept.
+        if (c == '!') {
+          code_char('#');
+          code_char(c);
+          state_ = KEEP_LINE;
+        } else {
+          comment('#');
+          state_ = LINE_COMMENT;
+          step(c);
+        }
+        break;
+
+      case KEEP_LINE:
+        code_char(c);
+        if (c == '\n')
+          state_ = CODE;
+        break;
+
+      case LINE_COMMENT:
+        if (c == '\n') {
+          state_ = CODE;
+          comment(c);
+          prev_ = c;
+        } else {
+          comment(c);
+        }
+        break;
+
+      case BLOCK_COMMENT:
+      case BLOCK_STAR:
+      case BLOCK_SLASH:
+        comment(c);
+        if (state_ == BLOCK_STAR && c == '/') {
+          if (--depth_ == 0) {
+            state_ = CODE;
+            prev_ = ' ';
+          } else {
+            state_ = BLOCK_COMMENT;
+          }
+        } else if (state_ == BLOCK_SLASH && c == '*') {
+          depth_++;
+          state_ = BLOCK_COMMENT;
+        } else if (c == '*') {
+          state_ = BLOCK_STAR;
+        } else if (c == '/' && syntax_->nested_blocks) {
+          state_ = BLOCK_SLASH;
+        } else {
+          state_ = BLOCK_COMMENT;
+        }
+        break;
+
+      case STRING:
+        literal(c);
+        // Backtick strings and shell single quotes have no escapes.
+        if (c == '\\' && quote_ != '`' &&
+            !(quote_ == '\'' && syntax_->hash_word_start)) {
+          state_ = STRING_ESCAPE;
+        } else if (c == quote_) {
+          state_ = CODE;
+          prev_ = prev_code_ = c;
+        } else if (c == '\n' && quote_ != '`' && !syntax_->hash_word_start) {
+          // Unterminated literal: resynchronise at the end of the line.
+          state_ = CODE;
+          prev_ = prev_code_ = c;
+        }
+        break;
+
+      case STRING_ESCAPE:
+        literal(c);
+        state_ = STRING;
+        break;
+
+      case QUOTE_PAIR:
+        // Seen one quote; a second makes either "" or the start of """.
+        if (c == quote_ && quote_run_ == 1) {
+          quote_run_ = 2;
+        } else if (c == quote_ && quote_run_ == 2) {
+          code(quote_);
+          code(quote_);
+          state_ = TRIPLE_STRING;
+          quote_run_ = 0;
+        } else if (quote_run_ == 2) {
+          code(quote_);
+          state_ = CODE;
+          prev_ = prev_code_ = quote_;
+          step(c);
+        } else {
+          state_ = STRING;
+          step(c);
+        }
+        break;
+
+      case TRIPLE_STRING:
+        literal(c);
+        if (c == '\\') {
+          state_ = TRIPLE_ESCAPE;
+        } else if (c == quote_) {
+          if (++quote_run_ == 3) {
+            state_ = CODE;
+            prev_ = prev_code_ = c;
+          }
+        } else {
+          quote_run_ = 0;
+        }
+        break;
+
+      case TRIPLE_ESCAPE:
+        literal(c);
+        quote_run_ = 0;
+        state_ = TRIPLE_STRING;
+        break;
+
+      case RUST_QUOTE:
+        // 'x' and '\n' are chars; 'a followed by anything else a lifetime.
+        code_char(c);
+        if (c == '\\') {
+          state_ = STRING_ESCAPE;
+        } else if (c == '\n') {
+          state_ = CODE;
+        } else {
+          state_ = RUST_QUOTE_CHAR;
+        }
+        break;
+
+      case RUST_QUOTE_CHAR:
+        if ((c & 0xc0) == 0x80) {
+          code_char(c);
+          break;
+        }
+        state_ = CODE;
+        if (c == '\'') {
+          code_char(c);
+        } else {
+          step(c);
+        }
+        break;
+
+      case REGEX:
+      case REGEX_ESCAPE:
+      case REGEX_CLASS:
+        step_regex(c);
+        break;
+    }
+    first_byte_ = false;
+  }
+
+  void step_regex(char c) {
+    literal(c);
+    if (state_ == REGEX_ESCAPE) {
+      state_ = REGEX;
+    } else if (c == '\\') {
+      state_ = REGEX_ESCAPE;
+    } else if (state_ == REGEX_CLASS) {
+      if (c == ']')
+        state_ = REGEX;
+    } else if (c == '[') {
+      state_ = REGEX_CLASS;
+    } else if (c == '/' || c == '\n') {
+      state_ = CODE;
+      prev_ = prev_code_ = ')';
+    }
+  }
+
+  const LexerSyntax* syntax_;
+  bool strip_;
+  bool collapse_;
+  std::string& out_;
+  std::string pending_ws_;
+  State state_ = CODE;
+  char prev_ = '\0';
+  char prev_code_ = '\0';
+  char quote_ = '\0';
+  int quote_run_ = 0;
+  int depth_ = 0;
+  int blank_lines_ = 0;
+  bool line_has_code_ = false;
+  bool line_had_comment_ = false;
+  bool at_start_ = true;
+  bool first_byte_ = true;
+  bool special_[256] = {};
+  bool special_in_line_[256] = {};
+};
+
+// Finds needle in data. With SSE2, candidate positions are those where
+// both the first and the last needle byte match, tested 16 at a time; only
+// those are compared in full.
+static bool contains_literal(const char* data,
+                             size_t size,
+                             const std::string& needle) {
+  size_t k = needle.size();
+  if (k == 0)
+    return true;
+  if (k > size)
+    return false;
+  if (k == 1)
+    return memchr(data, needle[0], size) != nullptr;
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[k - 1]);
+  for (; i + k - 1 + 16 <= size; i += 16) {
+    __m128i block_first =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    __m128i block_last =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + k - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+    while (mask) {
+      size_t pos = i + __builtin_ctz(mask);
+      if (memcmp(data + pos + 1, needle.data() + 1, k - 2) == 0)
+        return true;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  return memmem(data + i, size - i, needle.data(), k) != nullptr;
+}
+
+// Extracts, for each top-level alternative of a POSIX extended regex, the
+// longest run of literal characters that every match of that alternative
+// must contain. Returns an empty list when some alternative has none, as
+// no prefilter is then possible. pure is set when every alternative is a
+// plain literal, so finding any of them is a match and no regex is needed.
+static std::vector<std::string> required_literals(const std::string& re,
+                                                  bool& pure) {
+  std::vector<std::string> literals;
+  std::string run, best;
+  bool branch_pure = true;
+  pure = true;
+  auto commit = [&]() {
+    if (run.size() > best.size())
+      best = run;
+    run.clear();
+  };
+  auto skip_bracket = [&](size_t i) {
+    i++;
+    if (i < re.size() && re[i] == '^')
+      i++;
+    if (i < re.size() && re[i] == ']')
+      i++;
+    while (i < re.size() && re[i] != ']') {
+      if (re[i] == '[' && i + 1 < re.size() && strchr(":.=", re[i + 1])) {
+        size_t close = re.find(std::string(1, re[i + 1]) + "]", i + 2);
+        i = close == std::string::npos ? re.size() : close + 1;
+      }
+      i++;
+    }
+    return i;
+  };
+
+  size_t i = 0;
+  while (i <= re.size()) {
+    if (i == re.size() || re[i] == '|') {
+      commit();
+      if (best.empty())
+        return {};
+      literals.push_back(best);
+      best.clear();
+      pure = pure && branch_pure;
+      branch_pure = true;
+      i++;
+      continue;
+    }
+
+    char c = re[i];
+    bool literal = false;
+    size_t next = i + 1;
+    if (c == '\\' && i + 1 < re.size()) {
+      literal = strchr(".[]()*+?{}|^$\\/", re[i + 1]) != nullptr;
+      c = re[i + 1];
+      next = i + 2;
+    } else if (c == '[') {
+      next = skip_bracket(i) + 1;
+    } else if (c == '(') {
+      int depth = 0;
+      for (next = i; next < re.size(); next++) {
+        if (re[next] == '\\') {
+          next++;
+        } else if (re[next] == '[') {
+          next = skip_bracket(next);
+        } else if (re[next] == '(') {
+          depth++;
+        } else if (re[next] == ')' && --depth == 0) {
+          break;
+        }
+      }
+      next++;
+    } else {
+      literal = !strchr(".^$*+?{)", c);
+    }
+
+    char quantifier = next < re.size() ? re[next] : '\0';
+    if (quantifier == '{') {
+      // {0,...} makes the atom optional; {n,...} with n > 0 does not.
+      quantifier = next + 1 < re.size() && re[next + 1] == '0' ? '*' : '+';
+    }
+    if (literal && quantifier != '*' && quantifier != '?') {
+      run += c;
+      if (quantifier == '+')
+        commit();
+    } else {
+      commit();
+    }
+    if (!literal || quantifier == '*' || quantifier == '?' ||
+        quantifier == '+') {
+      branch_pure = false;
+    }
+    if (next < re.size() && strchr("*?+{", re[next])) {
+      if (re[next] == '{') {
+        size_t close = re.find('}', next);
+        next = close == std::string::npos ? re.size() : close;
+      }
+      next++;
+    }
+    i = next;
+  }
+  return literals;
+}
+
+class RegexPattern {
+ public:
+  RegexPattern() = default;
+  RegexPattern(const RegexPattern&) = delete;
+  RegexPattern& operator=(const RegexPattern&) = delete;
+  ~RegexPattern() {
+    if (compiled_)
+      regfree(&regex_);
+  }
+
+  bool compile(const std::string& pattern) {
+    literals_ = required_literals(pattern, pure_);
+    int err = regcomp(&regex_, pattern.c_str(), REG_EXTENDED | REG_NEWLINE);
+    if (err != 0) {
+      char message[256];
+      regerror(err, &regex_, message, sizeof(message));
+      printe("Invalid pattern %s: %s\n", pattern.c_str(), message);
+      return false;
+    }
+    compiled_ = true;
+    return true;
+  }
+
+  // Runs the literal prefilter first; the regex engine only sees content
+  // that contains one of the required literals.
+  bool matches(const std::string& content) const {
+    if (!literals_.empty()) {
+      bool found = std::any_of(
+          literals_.begin(), literals_.end(), [&](const std::string& lit) {
+            return contains_literal(content.data(), content.size(), lit);
+          });
+      if (!found)
+        return false;
+      if (pure_)
+        return true;
+    }
+    regmatch_t match;
+    match.rm_so = 0;
+    match.rm_eo = content.size();
+    return regexec(&regex_, content.c_str(), 1, &match, REG_STARTEND) == 0;
+  }
+
+ private:
+  regex_t regex_;
+  bool compiled_ = false;
+  bool pure_ = false;
+  std::vector<std::string> literals_;
+};
+
+// Content filter for --grep/--grep-not: a file is kept if it matches any
+// --grep pattern (or there are none) and no --grep-not pattern.
+class GrepFilter {
+ public:
+  static std::shared_ptr<const GrepFilter> create(
+      const std::vector<std::string>& include,
+      const std::vector<std::string>& exclude) {
+    std::shared_ptr<GrepFilter> filter(new GrepFilter());
+    if (!filter->add(include, filter->include_) ||
+        !filter->add(exclude, filter->exclude_)) {
+      return nullptr;
+    }
+    return filter;
+  }
+
+  bool accepts(const std::string& content) const {
+    auto matches = [&](const std::unique_ptr<RegexPattern>& pattern) {
+      return pattern->matches(content);
+    };
+    return (include_.empty() ||
+            std::any_of(include_.begin(), include_.end(), matches)) &&
+           std::none_of(exclude_.begin(), exclude_.end(), matches);
+  }
+
+ private:
+  bool add(const std::vector<std::string>& patterns,
+           std::vector<std::unique_ptr<RegexPattern>>& out) {
+    for (const auto& pattern : patterns) {
+      out.emplace_back(new RegexPattern());
+      if (!out.back()->compile(pattern))
+        return false;
+    }
+    return true;
+  }
+
+  std::vector<std::unique_ptr<RegexPattern>> include_;
+  std::vector<std::unique_ptr<RegexPattern>> exclude_;
+};
+
+// Transform stage between reading a file and printing it.
+static void transform_content(const std::string& path,
+                              std::string& content,
+                              const Opt& opt) {
+  if (!opt.strip_comments && !opt.collapse_whitespace)
+    return;
+  std::string out;
+  out.reserve(content.size());
+  Minifier minifier(syntax_for_path(path), opt.strip_comments,
+                    opt.collapse_whitespace, out);
+  const size_t chunk = 1 << 16;
+  for (size_t pos = 0; pos < content.size(); pos += chunk) {
+    minifier.feed(content.data() + pos, std::min(chunk, content.size() - pos));
+  }
+  minifier.finish();
+  content.swap(out);
+}
+
+// Light per-language line scanners behind --chunk-bytes and --outline.
+// They follow just enough syntax to find where declarations start: bracket
+// depth with comments and strings, indentation, declaration keywords at the
+// start of a line, or Markdown headings.
+enum LineScanner {
+  SCAN_LINES,     // nothing but blank lines
+  SCAN_BRACES,    // bracket depth (C family, Go, Rust, JavaScript, ...)
+  SCAN_INDENT,    // indentation (Python, YAML)
+  SCAN_KEYWORDS,  // declaration keywords starting a line
+  SCAN_HEADINGS,  // Markdown headings
+};
+
+static bool is_word_char(char c) {
+  return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ||
+         c == '_';
+}
+
+// Whether [p, end) starts with one of the space-separated keywords as a
+// whole word.
+static bool starts_with_keyword(const char* p,
+                                const char* end,
+                                const char* keywords) {
+  while (*keywords) {
+    const char* stop = strchr(keywords, ' ');
+    size_t len = stop ? stop - keywords : strlen(keywords);
+    if (static_cast<size_t>(end - p) >= len &&
+        (*p | 0x20) == (*keywords | 0x20) && !strncasecmp(p, keywords, len) &&
+        (p + len == end || !is_word_char(p[len])))
+      return true;
+    keywords += stop ? len + 1 : len;
+  }
+  return false;
+}
+
+// A keyword list for starts_with_keyword, split once and bucketed by first
+// letter, for the scanners that test every line against a long list.
+class KeywordSet {
+ public:
+  explicit KeywordSet(const char* keywords) {
+    for (const char* p = keywords; *p;) {
+      const char* stop = strchr(p, ' ');
+      size_t len = stop ? stop - p : strlen(p);
+      words_.emplace_back(p, len);
+      p += stop ? len + 1 : len;
+    }
+    std::stable_sort(words_.begin(), words_.end(),
+                     [](const std::string& a, const std::string& b) {
+                       return bucket(a[0]) < bucket(b[0]);
+                     });
+    for (size_t i = 0, c = 0; c <= 256; c++) {
+      while (i < words_.size() && bucket(words_[i][0]) < c)
+        i++;
+      first_[c] = i;
+    }
+  }
+
+  bool empty() const { return words_.empty(); }
+
+  // Whether [p, end) starts with one of the keywords as a whole word.
+  bool starts(const char* p, const char* end) const {
+    if (p == end)
+      return false;
+    size_t c = bucket(*p);
+    for (size_t i = first_[c]; i < first_[c + 1]; i++) {
+      const std::string& word = words_[i];
+      size_t len = word.size();
+      if (static_cast<size_t>(end - p) >= len &&
+          !strncasecmp(p, word.data(), len) &&
+          (p + len == end || !is_word_char(p[len])))
+        return true;
+    }
+    return false;
+  }
+
+ private:
+  static size_t bucket(char c) { return static_cast<unsigned char>(c | 0x20); }
+
+  std::vector<std::string> words_;
+  uint8_t first_[257];
+};
+
+struct ScanLanguage {
+  LineScanner scanner;
+  const KeywordSet* keywords;  // matched case-insensitively
+};
+
+static ScanLanguage scan_language_for_path(const std::string& path) {
+  static const char braces[] =
+      "async class const def enum export extern fn func function impl "
+      "import interface let mod module namespace package pub static "
+      "struct template trait type union use var";
+  static const struct {
+    const char* language;
+    LineScanner scanner;
+    const char* keywords;  // space-separated
+  } languages[] = {
+      {"c", SCAN_BRACES, braces},
+      {"cpp", SCAN_BRACES, braces},
+      {"objectivec", SCAN_BRACES, braces},
+      {"csharp", SCAN_BRACES, braces},
+      {"java", SCAN_BRACES, braces},
+      {"kotlin", SCAN_BRACES, braces},
+      {"scala", SCAN_BRACES, braces},
+      {"swift", SCAN_BRACES, braces},
+      {"dart", SCAN_BRACES, braces},
+      {"go", SCAN_BRACES, braces},
+      {"rust", SCAN_BRACES, braces},
+      {"zig", SCAN_BRACES, braces},
+      {"javascript", SCAN_BRACES, braces},
+      {"jsx", SCAN_BRACES, braces},
+      {"typescript", SCAN_BRACES, braces},
+      {"tsx", SCAN_BRACES, braces},
+      {"php", SCAN_BRACES, braces},
+      {"groovy", SCAN_BRACES, braces},
+      {"protobuf", SCAN_BRACES, "enum message service"},
+      {"graphql", SCAN_BRACES, "type input enum interface query"},
+      {"css", SCAN_BRACES, ""},
+      {"scss", SCAN_BRACES, ""},
+      {"less", SCAN_BRACES, ""},
+      {"python", SCAN_INDENT, "async class def"},
+      {"yaml", SCAN_INDENT, ""},
+      {"ruby", SCAN_KEYWORDS, "class def module"},
+      {"lua", SCAN_KEYWORDS, "function local"},
+      {"elixir", SCAN_KEYWORDS,
+       "def defimpl defmacro defmodule defp defprotocol"},
+      {"julia", SCAN_KEYWORDS,
+       "abstract function macro module mutable struct"},
+      {"ocaml", SCAN_KEYWORDS, "let module type"},
+      {"sql", SCAN_KEYWORDS,
+       "alter create delete drop grant insert select update with"},
+      {"bash", SCAN_KEYWORDS, "function"},
+      {"zsh", SCAN_KEYWORDS, "function"},
+      {"fish", SCAN_KEYWORDS, "function"},
+      {"powershell", SCAN_KEYWORDS, "class filter function"},
+      {"cmake", SCAN_KEYWORDS, "function macro"},
+      {"dockerfile", SCAN_KEYWORDS, "from"},
+      {"latex", SCAN_KEYWORDS, "\\chapter \\section \\subsection"},
+      {"markdown", SCAN_HEADINGS, ""},
+  };
+  static const std::vector<KeywordSet> keyword_sets = [] {
+    std::vector<KeywordSet> sets;
+    for (const auto& entry : languages)
+      sets.emplace_back(entry.keywords);
+    return sets;
+  }();
+  static const KeywordSet no_keywords("");
+  const char* language = language_for_path(path);
+  for (size_t i = 0; i < sizeof(languages) / sizeof(languages[0]); i++) {
+    if (!strcmp(languages[i].language, language))
+      return {languages[i].scanner, &keyword_sets[i]};
+  }
+  return {SCAN_LINES, &no_keywords};
+}
+
+static bool starts_with(const char* p, const char* end, const char* prefix) {
+  size_t len = strlen(prefix);
+  return static_cast<size_t>(end - p) >= len && !memcmp(p, prefix, len);
+}
+
+// Calls fn(start, p, end) for every line of content, where [start, end)
+// is the line without its line break and p its first non-blank byte.
+template <typename Fn>
+static void for_each_line(const std::string& content, Fn fn) {
+  const char* data = content.data();
+  const char* stop = data + content.size();
+  for (const char* start = data; start < stop;) {
+    const char* end =
+        static_cast<const char*>(memchr(start, '\n', stop - start));
+    const char* next = end ? end + 1 : stop;
+    if (!end)
+      end = stop;
+    if (end > start && end[-1] == '\r')
+      end--;
+    const char* p = start;
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+    fn(start, p, end);
+    start = next;
+  }
+}
+
+static bool is_fence(const char* p, const char* end) {
+  return starts_with(p, end, "```") || starts_with(p, end, "~~~");
+}
+
+// Level of a Markdown heading starting the line, or 0.
+static int heading_level(const char* start, const char* p, const char* end) {
+  if (p != start || *p != '#')
+    return 0;
+  const char* q = p;
+  while (q < end && *q == '#')
+    q++;
+  return q == end || *q == ' ' ? q - p : 0;
+}
+
+// Comment lines of the languages SCAN_KEYWORDS covers.
+static bool is_line_comment(const char* p, const char* end) {
+  return *p == '#' || *p == '%' || starts_with(p, end, "--");
+}
+
+// Follows comments and strings across the lines of a brace language, and
+// hands the brackets and semicolons it finds in code to a callback.
+class BraceLexer {
+ public:
+  explicit BraceLexer(const std::string& path)
+      : syntax_(syntax_for_path(path)) {
+    static const LexerSyntax c_like = {true,  false, false, false, false,
+                                       false, false, false, false};
+    if (!syntax_)
+      syntax_ = &c_like;
+  }
+
+  const LexerSyntax& syntax() const { return *syntax_; }
+  bool in_comment() const { return comment_ > 0; }
+  bool in_literal() const { return comment_ > 0 || quote_; }
+
+  // Whether the line starting at p (outside any literal) holds only a
+  // comment.
+  bool is_comment_line(const char* p, const char* end) const {
+    return (syntax_->slash_comments &&
+            (starts_with(p, end, "//") || starts_with(p, end, "/*"))) ||
+           (syntax_->hash_comments && *p == '#');
+  }
+
+  // Whether the line starting at p is a C preprocessor directive.
+  bool is_directive(const char* p, const char* end) const {
+    return !syntax_->hash_comments && *p == '#' && !starts_with(p, end, "#[");
+  }
+
+  // Whether the last code seen ended a statement or opened or closed a
+  // block, so that a new declaration may follow.
+  bool after_statement() const {
+    return !last_code_ || last_code_ == ';' || last_code_ == '{' ||
+           last_code_ == '}';
+  }
+
+  void end_statement() { last_code_ = ';'; }
+
+  // Scans the line from p to end; on_code(q, c) is called for every
+  // bracket and semicolon outside comments and strings.
+  template <typename OnCode>
+  void scan(const char* p, const char* end, OnCode on_code) {
+    static const auto special = [] {
+      std::array<bool, 256> table = {};
+      for (unsigned char c : std::string("'\"`/#{}()[];"))
+        table[c] = true;
+      return table;
+    }();
+    char last = last_code_;
+    for (const char* q = p; q < end; q++) {
+      if (comment_) {
+        if (!syntax_->nested_blocks) {
+          q = static_cast<const char*>(memchr(q, '*', end - q));
+          if (!q)
+            break;
+        }
+        if (*q == '*' && q + 1 < end && q[1] == '/') {
+          comment_--;
+          q++;
+        } else if (syntax_->nested_blocks && *q == '/' && q + 1 < end &&
+                   q[1] == '*') {
+          comment_++;
+          q++;
+        }
+        continue;
+      }
+      if (quote_) {
+        while (q < end && *q != quote_ && *q != '\\')
+          q++;
+        if (q == end)
+          break;
+        if (*q == quote_)
+          quote_ = 0;
+        else if (q + 1 < end)
+          q++;
+        continue;
+      }
+      // Skip ordinary code in one go, remembering its last visible byte.
+      const char* run = q;
+      while (q < end && !special[static_cast<unsigned char>(*q)])
+        q++;
+      for (const char* r = q; r > run; r--) {
+        if (r[-1] != ' ' && r[-1] != '\t' && r[-1] != '\r') {
+          last = r[-1];
+          break;
+        }
+      }
+      if (q == end)
+        break;
+      char c = *q;
+      if (syntax_->slash_comments && c == '/' && q + 1 < end) {
+        if (q[1] == '/')
+          break;
+        if (q[1] == '*') {
+          comment_ = 1;
+          q++;
+          continue;
+        }
+      }
+      if (syntax_->hash_comments && c == '#' &&
+          (!syntax_->hash_word_start || q == p || isspace(q[-1])))
+        break;
+      switch (c) {
+        case '\'':
+          // Digit separators and Rust lifetimes are not character literals.
+          if ((q > p && is_word_char(q[-1])) ||
+              (syntax_->rust_chars && q + 2 < end && q[1] != '\\' &&
+               q[2] != '\''))
+            break;
+          quote_ = c;
+          break;
+        case '`':
+          if (syntax_->backtick_strings)
+            quote_ = c;
+          break;
+        case '"':
+          quote_ = c;
+          break;
+        case '/':
+        case '#':
+          break;
+        default:
+          on_code(q, c);
+          break;
+      }
+      last = c;
+    }
+    last_code_ = last;
+    // Only template and raw strings run on past the end of a line.
+    if (quote_ && quote_ != '`')
+      quote_ = 0;
+  }
+
+ private:
+  const LexerSyntax* syntax_;
+  int comment_ = 0;
+  char quote_ = 0;
+  char last_code_ = 0;
+};
+
+// Follows strings and brackets across the lines of an indentation-based
+// language.
+class IndentLexer {
+ public:
+  // Whether the next line continues the current statement: inside
+  // brackets or a multi-line string, or after a trailing backslash.
+  bool inside() const { return quote_ || depth_ > 0 || continued_; }
+
+  void scan(const char* p, const char* end) {
+    for (const char* q = p; q < end; q++) {
+      char c = *q;
+      if (quote_) {
+        if (c == '\\') {
+          q += q + 1 < end ? 1 : 0;
+        } else if (c == quote_ && (!triple_ || (q + 2 < end && q[1] == c &&
+                                                 q[2] == c))) {
+          q += triple_ ? 2 : 0;
+          quote_ = 0;
+        }
+        continue;
+      }
+      switch (c) {
+        case '#':
+          q = end - 1;
+          break;
+        case '\'':
+        case '"':
+          quote_ = c;
+          triple_ = q + 2 < end && q[1] == c && q[2] == c;
+          q += triple_ ? 2 : 0;
+          break;
+        case '{':
+        case '(':
+        case '[':
+          depth_++;
+          break;
+        case '}':
+        case ')':
+        case ']':
+          if (depth_ > 0)
+            depth_--;
+          break;
+      }
+    }
+    continued_ = end > p && end[-1] == '\\';
+    if (quote_ && !triple_)
+      quote_ = 0;
+  }
+
+ private:
+  int depth_ = 0;
+  char quote_ = 0;
+  bool triple_ = false;
+  bool continued_ = false;
+};
+
+// How good a place the start of a line is for --chunk-bytes to cut, lower
+// being better: 0 to 2 where a declaration starts at that nesting depth
+// (moved up over the comments and attributes that belong to it), 3 after
+// a blank line and 4 anywhere else.
+struct ChunkLine {
+  size_t offset;
+  uint8_t rank;
+  bool attached;  // a comment or attribute that goes with the next line
+};
+
+const uint8_t kRankDeclaration = 2;  // worst rank of a declaration start
+const uint8_t kRankBlank = 3;
+const uint8_t kRankAnywhere = 4;
+
+// Rates lines one at a time.
+class LineRater {
+ public:
+  explicit LineRater(const std::string& path)
+      : language_(scan_language_for_path(path)), braces_(path) {}
+
+  // Rates the non-blank line [start, end), p being its first non-blank
+  // byte. Returns whether the line is inside a comment or string that
+  // began on an earlier one.
+  bool rate(const char* start, const char* p, const char* end,
+            ChunkLine& line) {
+    switch (language_.scanner) {
+      case SCAN_BRACES:
+        return rate_braces(p, end, line);
+      case SCAN_INDENT:
+        return rate_indent(start, p, end, line);
+      case SCAN_KEYWORDS:
+        if (is_line_comment(p, end))
+          line.attached = true;
+        else if (language_.keywords->starts(p, end))
+          line.rank = p == start ? 0 : 1;
+        return false;
+      case SCAN_HEADINGS:
+        if (is_fence(p, end)) {
+          fenced_ = !fenced_;
+          return !fenced_;
+        }
+        if (fenced_)
+          return true;
+        if (int level = heading_level(start, p, end)) {
+          line.rank = std::min<int>(level - 1, kRankDeclaration);
+        } else if (p == start && (starts_with(p, end, "- ") ||
+                                  starts_with(p, end, "* ") ||
+                                  starts_with(p, end, "+ "))) {
+          line.rank = kRankDeclaration;
+        }
+        return false;
+      case SCAN_LINES:
+        break;
+    }
+    return false;
+  }
+
+ private:
+  bool rate_braces(const char* p, const char* end, ChunkLine& line) {
+    auto count_depth = [&](const char*, char c) {
+      if (c == '{' || c == '(' || c == '[')
+        depth_++;
+      else if (c != ';' && depth_ > 0)
+        depth_--;
+    };
+    if (braces_.in_literal()) {
+      line.attached = braces_.in_comment();
+      braces_.scan(p, end, count_depth);
+      return true;
+    }
+    bool comment_line = braces_.is_comment_line(p, end);
+    bool attribute = *p == '@' || starts_with(p, end, "#[") ||
+                     starts_with_keyword(p, end, "template");
+    bool directive = braces_.is_directive(p, end);
+    line.attached = comment_line || attribute;
+    bool continuation = strchr(".,)]}&|?:", *p) != nullptr;
+    if (!comment_line && !continuation &&
+        (braces_.after_statement() ||
+         language_.keywords->starts(p, end)))
+      line.rank = std::min<int>(depth_, kRankDeclaration);
+    braces_.scan(p, end, count_depth);
+    if (directive && end[-1] != '\\')
+      braces_.end_statement();
+    return false;
+  }
+
+  bool rate_indent(const char* start,
+                   const char* p,
+                   const char* end,
+                   ChunkLine& line) {
+    bool inside = indent_.inside();
+    if (!inside) {
+      line.attached = *p == '#' || *p == '@';
+      if (*p != '#' && !strchr(")]}", *p) &&
+          !starts_with_keyword(p, end, "elif else except finally")) {
+        if (p == start)
+          line.rank = 0;
+        else if (*p == '@' || language_.keywords->starts(p, end))
+          line.rank = 1;
+      }
+    }
+    indent_.scan(p, end);
+    return inside;
+  }
+
+  ScanLanguage language_;
+  BraceLexer braces_;
+  IndentLexer indent_;
+  int depth_ = 0;
+  bool fenced_ = false;
+};
+
+// Cuts content into chunks of about target bytes and at most max bytes,
+// only ever at the start of a line; a longer line is a chunk of its own.
+// Each cut goes to the best-rated line between half the target size and
+// the maximum, preferring the first one past the target.
+static void chunk_content(const std::string& path,
+                          const std::string& content,
+                          uint64_t target,
+                          uint64_t max,
+                          std::vector<Chunk>& chunks) {
+  std::vector<ChunkLine> lines;
+  lines.reserve(count_byte(content.data(), content.size(), '\n') + 1);
+  LineRater rater(path);
+  bool after_blank = true;
+  for_each_line(content, [&](const char* start, const char* p,
+                             const char* end) {
+    ChunkLine line = {size_t(start - content.data()), kRankAnywhere, false};
+    bool blank = p == end;
+    if (!blank && !rater.rate(start, p, end, line) && after_blank)
+      line.rank = std::min(line.rank, kRankBlank);
+    lines.push_back(line);
+    after_blank = blank;
+  });
+
+  // Comments and attributes go with the declaration below them.
+  for (size_t i = 1; i < lines.size(); i++) {
+    if (lines[i].attached || lines[i].rank > kRankDeclaration)
+      continue;
+    size_t j = i;
+    while (j > 0 && lines[j - 1].attached)
+      j--;
+    if (j == i)
+      continue;
+    lines[j].rank = std::min(lines[j].rank, lines[i].rank);
+    for (size_t k = j + 1; k <= i; k++)
+      lines[k].rank = kRankAnywhere;
+  }
+
+  auto offset_of = [&](size_t line) {
+    return line < lines.size() ? lines[line].offset : content.size();
+  };
+  const uint64_t min = target / 2;
+  for (size_t first = 0; first < lines.size();) {
+    size_t begin = lines[first].offset;
+    size_t cut = lines.size();
+    if (content.size() - begin > target) {
+      size_t best = 0;
+      size_t fallback = first + 1;
+      int best_rank = kRankAnywhere + 1;
+      for (size_t k = first + 1; k <= lines.size(); k++) {
+        uint64_t len = offset_of(k) - begin;
+        if (len > max)
+          break;
+        fallback = k;
+        if (len < min)
+          continue;
+        // The end of the content is as good as any declaration.
+        int rank = k < lines.size() ? lines[k].rank : 0;
+        if (rank < best_rank ||
+            (rank == best_rank && offset_of(best) - begin < target)) {
+          best = k;
+          best_rank = rank;
+        }
+        if (best_rank == 0 && offset_of(best) - begin >= target)
+          break;
+      }
+      cut = best ? best : fallback;
+    }
+    chunks.push_back({begin, offset_of(cut), first + 1, cut});
+    first = cut;
+  }
+}
+
+// Whether a block opened after `header` holds declarations (a class,
+// namespace or similar) rather than code or data.
+static bool is_scope_header(const char* p, const char* end) {
+  static const KeywordSet keywords(
+      "class enum extension extern impl interface message mod module "
+      "namespace object protocol record service struct trait union");
+  bool scope = false;
+  for (const char* q = p; q < end; q++) {
+    if (*q == '(' || *q == '=')
+      return false;
+    if (!scope && is_word_char(*q) && (q == p || !is_word_char(q[-1])))
+      scope = keywords.starts(q, end);
+  }
+  return scope;
+}
+
+static bool is_string_start(const char* p, const char* end) {
+  for (int i = 0; i < 2 && p < end && strchr("bfruBFRU", *p); i++)
+    p++;
+  return p < end && (*p == '"' || *p == '\'');
+}
+
+// Reduces a file to its outline for --outline, a line at a time. Brace
+// languages keep everything outside function bodies and initializers,
+// whose contents turn into "...": declarations, signatures, type
+// definitions and the comments around them. Python keeps what is not in
+// a def body, plus the docstring that opens it. Keyword languages keep
+// the declaring lines with the comments right above them, and Markdown
+// its headings.
+class Outliner {
+ public:
+  Outliner(const std::string& path, std::string& out)
+      : language_(scan_language_for_path(path)), out_(out), braces_(path) {}
+
+  bool supported() const { return language_.scanner != SCAN_LINES; }
+
+  // Takes the line [start, end), p being its first non-blank byte.
+  void add(const char* start, const char* p, const char* end) {
+    switch (language_.scanner) {
+      case SCAN_BRACES:
+        add_braces(start, p, end);
+        break;
+      case SCAN_INDENT:
+        if (!language_.keywords->empty())
+          add_indented(start, p, end);
+        else
+          add_declaration(start, p, end, p == start);
+        break;
+      case SCAN_KEYWORDS:
+        add_declaration(start, p, end,
+                        language_.keywords->starts(p, end));
+        break;
+      case SCAN_HEADINGS:
+        if (is_fence(p, end))
+          fenced_ = !fenced_;
+        else if (!fenced_ && heading_level(start, p, end))
+          emit(start, end);
+        break;
+      case SCAN_LINES:
+        break;
+    }
+  }
+
+  void finish() {
+    if (body_depth_ > 0 && dropped_)
+      emit_placeholder();
+  }
+
+ private:
+  void emit(const char* start, const char* end) {
+    out_.append(start, end);
+    out_ += '\n';
+  }
+
+  // Blank lines are kept between declarations, but never two in a row.
+  void emit_blank() {
+    if (out_.size() > 1 && out_[out_.size() - 2] != '\n')
+      out_ += '\n';
+  }
+
+  void emit_placeholder() {
+    out_ += placeholder_;
+    out_ += "...\n";
+  }
+
+  void add_braces(const char* start, const char* p, const char* end) {
+    bool in_body = body_depth_ > 0;
+    if (p == end) {
+      if (!in_body && !braces_.in_literal())
+        emit_blank();
+      return;
+    }
+    if (directive_ || (!braces_.in_literal() && braces_.is_directive(p, end))) {
+      directive_ = end[-1] == '\\';
+      if (!in_body)
+        emit(start, end);
+      return;
+    }
+    // A declaration's header starts with the first code after the
+    // previous statement or attribute.
+    bool code = !braces_.in_literal() && !braces_.is_comment_line(p, end);
+    if (!header_ ||
+        (code && (braces_.after_statement() || after_attribute_ ||
+                  language_.keywords->starts(p, end))))
+      header_ = p;
+    if (code)
+      after_attribute_ = *p == '@' || starts_with(p, end, "#[");
+    braces_.scan(p, end, [&](const char* q, char c) {
+      if (c == '{') {
+        bool scope = body_depth_ == 0 && is_scope_header(header_, q);
+        scopes_.push_back(scope);
+        if (!scope && body_depth_++ == 0)
+          dropped_ = false;
+      } else if (c == '}' && !scopes_.empty()) {
+        if (!scopes_.back())
+          body_depth_--;
+        scopes_.pop_back();
+      }
+      if (c == '{' || c == '}' || c == ';')
+        header_ = q + 1;
+    });
+    if (!in_body) {
+      emit(start, end);
+    } else if (body_depth_ == 0) {
+      if (dropped_)
+        emit_placeholder();
+      emit(start, end);
+    } else if (!dropped_) {
+      dropped_ = true;
+      placeholder_.assign(start, p);
+    }
+  }
+
+  void add_indented(const char* start, const char* p, const char* end) {
+    bool statement = !indent_.inside();
+    if (statement && p < end) {
+      int indent = p - start;
+      if (body_indent_ >= 0 && indent <= body_indent_) {
+        body_indent_ = -1;
+        if (blank_pending_)
+          emit_blank();
+      }
+      if (body_indent_ >= 0) {
+        keep_ = docstring_ && is_string_start(p, end);
+        if (!keep_ && !dropped_) {
+          dropped_ = true;
+          placeholder_.assign(start, p);
+          emit_placeholder();
+        }
+        docstring_ = false;
+      } else {
+        keep_ = true;
+        const char* def = p;
+        if (starts_with_keyword(def, end, "async")) {
+          def += 5;
+          while (def < end && (*def == ' ' || *def == '\t'))
+            def++;
+        }
+        if (starts_with_keyword(def, end, "def")) {
+          def_indent_ = indent;
+          def_pending_ = true;
+        }
+      }
+    }
+    blank_pending_ = p == end && (blank_pending_ || statement);
+    if (p == end) {
+      if (!statement && keep_)
+        emit(start, end);
+      else if (statement && body_indent_ < 0)
+        emit_blank();
+    } else if (keep_) {
+      emit(start, end);
+    }
+    indent_.scan(p, end);
+    if (def_pending_ && !indent_.inside()) {
+      def_pending_ = false;
+      body_indent_ = def_indent_;
+      docstring_ = true;
+      dropped_ = false;
+    }
+  }
+
+  void add_declaration(const char* start,
+                       const char* p,
+                       const char* end,
+                       bool declares) {
+    if (p < end && is_line_comment(p, end)) {
+      comments_.append(start, end);
+      comments_ += '\n';
+      return;
+    }
+    if (declares && p < end) {
+      out_ += comments_;
+      emit(start, end);
+    }
+    comments_.clear();
+  }
+
+  ScanLanguage language_;
+  std::string& out_;
+  BraceLexer braces_;
+  IndentLexer indent_;
+  std::string placeholder_;  // indentation for the "..." of a body
+  bool dropped_ = false;     // whether anything of the body was left out
+  // Brace languages: the open braces, true for scopes, and how many of
+  // them are bodies.
+  std::vector<bool> scopes_;
+  int body_depth_ = 0;
+  const char* header_ = nullptr;
+  bool after_attribute_ = false;
+  bool directive_ = false;
+  // Python: the indentation of the def whose body is being skipped.
+  int body_indent_ = -1;
+  int def_indent_ = 0;
+  bool def_pending_ = false;
+  bool docstring_ = false;
+  bool keep_ = true;
+  bool blank_pending_ = false;  // a blank line was left out with a body
+  // Keyword languages: comments waiting for the line they describe.
+  std::string comments_;
+  bool fenced_ = false;
+};
+
+// Replaces content with its outline. Returns false for files there is no
+// outline scanner for, and for those without any declarations.
+static bool outline_content(const std::string& path, std::string& content) {
+  std::string out;
+  Outliner outliner(path, out);
+  if (!outliner.supported())
+    return false;
+  for_each_line(content,
+                [&](const char* start, const char* p, const char* end) {
+                  outliner.add(start, p, end);
+                });
+  outliner.finish();
+  content.swap(out);
+  return !content.empty();
+}
+
+// Everything between reading a document and printing it, outlining and
+// chunking included. Safe to run on several threads at once; returns
+// whether the document is to be printed.
+static bool prepare_document(const std::string& path,
+                             std::string& content,
+                             const Opt& opt,
+                             std::vector<Chunk>& chunks) {
+  if (content.empty() || !normalize_encoding(path, content, opt))
+    return false;
+  if (opt.grep) {
+    if (!opt.grep->accepts(content))
+      return false;
+    apply_content_caps(content, opt);
+  }
+  if (opt.outline && !outline_content(path, content))
+    return false;
+  transform_content(path, content, opt);
+  if (content.empty())
+    return false;
+  if (opt.chunk_bytes) {
+    chunk_content(path, content, opt.chunk_bytes,
+                  opt.max_chunk_bytes ? opt.max_chunk_bytes
+                                      : 2 * opt.chunk_bytes,
+                  chunks);
+  }
+  return true;
+}
+
+// Prints a prepared document, one document per chunk if it was cut up.
+static void print_chunks(FILE* writer,
+                         const std::string& path,
+                         const std::string& content,
+                         const std::vector<Chunk>& chunks,
+                         const Opt& opt,
+                         int64_t mtime) {
+  if (chunks.empty()) {
+    print_path(writer, path, content, opt, mtime);
+    return;
+  }
+  std::string piece;
+  for (const Chunk& chunk : chunks) {
+    piece.assign(content, chunk.begin, chunk.end - chunk.begin);
+    print_path(writer, path, piece, opt, mtime, &chunk);
+  }
+}
+
+static void emit_document(FILE* writer,
+                          const std::string& path,
+                          std::string& content,
+                          const Opt& opt,
+                          int64_t mtime = -1) {
+  std::vector<Chunk> chunks;
+  if (prepare_document(path, content, opt, chunks)) {
+    print_chunks(writer, path, content, chunks, opt, mtime);
+  }
+}
+
+static size_t worker_count(const Opt& opt) {
+  if (opt.jobs)
+    return opt.jobs;
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Runs prepare(i) for every i in [0, count) on a pool of threads, a batch
+// at a time, then emit(i) on the calling thread in order, so output stays
+// deterministic while reads and transforms overlap.
+template <typename Prepare, typename Emit>
+static void run_batched(size_t count,
+                        size_t threads,
+                        Prepare prepare,
+                        Emit emit) {
+  const size_t batch_size = 256;
+  for (size_t begin = 0; begin < count; begin += batch_size) {
+    size_t end = std::min(begin + batch_size, count);
+    std::atomic<size_t> next(begin);
+    auto worker = [&]() {
+      for (size_t i; (i = next++) < end;) {
+        prepare(i);
+      }
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < std::min(threads, end - begin); t++)
+      pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool)
+      thread.join();
+
+    for (size_t i = begin; i < end; i++)
+      emit(i);
+  }
+}
+
+static void process_file(int dir_fd,
+                         const char* name,
+                         const std::string& path,
+                         const Opt& opt,
+                         FILE* writer) {
+  int64_t mtime = -1;
+  std::string content = read_file_content_at(dir_fd, name, path, opt, &mtime);
+  emit_document(writer, path, content, opt, mtime);
+}
+
+class ServeCache;
+// Set while --serve runs. The walk then reuses whatever has not changed
+// since an earlier request.
+static ServeCache* serve_cache = nullptr;
+
+// One directory's entries. Names are interned back to back, each followed
+// by a NUL, in a single buffer per directory and referenced by offset, so
+// sorting moves small records and filters get C strings without copying.
+struct DirEntry {
+  uint32_t name_offset;
+  uint32_t name_len;
+  bool is_dir;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+static bool read_dir_entries(int dir_fd,
+                             const std::string& path,
+                             const Opt& opt,
+                             std::string& names,
+                             std::vector<DirEntry>& entries) {
+  // The listing is read in one go, so a duplicate descriptor sharing the
+  // directory's offset is fine and leaves dir_fd open for the walk.
+  int list_fd = dup(dir_fd);
+  DIR* dir = list_fd >= 0 ? fdopendir(list_fd) : nullptr;
+  if (!dir) {
+    if (list_fd >= 0)
+      close(list_fd);
+    printe("Warning: Skipping directory %s due to error opening it\n",
+           path.c_str());
+    return false;
+  }
+  // Cached listings must serve any later request, so they are complete.
+  bool need_stat = opt.sort == SORT_SIZE || opt.sort == SORT_MTIME ||
+                   opt.has_stat_filters() || serve_cache;
+  while (struct dirent* de = readdir(dir)) {
+    const char* name = de->d_name;
+    if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+      continue;
+
+    DirEntry entry = {};
+    entry.is_dir = de->d_type == DT_DIR;
+    // Symlinks to files are read like files, but symlinked directories
+    // are not followed.
+    if (need_stat || de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) {
+      struct stat st;
+      if (fstatat(dirfd(dir), name, &st, 0) != 0)
+        continue;
+      entry.is_dir = S_ISDIR(st.st_mode) && de->d_type != DT_LNK;
+      if (S_ISDIR(st.st_mode) && !entry.is_dir)
+        continue;
+      entry.size = st.st_size;
+      entry.mtime_sec = st.st_mtim.tv_sec;
+      entry.mtime_nsec = st.st_mtim.tv_nsec;
+    }
+    entry.name_offset = names.size();
+    entry.name_len = strlen(name);
+    names.append(name, entry.name_len + 1);
+    entries.push_back(entry);
+  }
+  closedir(dir);
+  return true;
+}
+
+// Orders one directory's entries. Path order compares directories as if
+// their names ended in '/', which makes the depth-first walk emit files in
+// the same order as sorting all full paths, without ever holding them all.
+// Size and time orders list files first, ties broken by name, then
+// subdirectories by name.
+static void sort_dir_entries(const std::string& names,
+                             std::vector<DirEntry>& entries,
+                             SortOrder order) {
+  auto name_of = [&](const DirEntry& e) {
+    return std::string_view(names.data() + e.name_offset, e.name_len);
+  };
+  auto path_less = [&](const DirEntry& a, const DirEntry& b) {
+    std::string_view x = name_of(a), y = name_of(b);
+    size_t n = std::min(x.size(), y.size());
+    int cmp = memcmp(x.data(), y.data(), n);
+    if (cmp != 0)
+      return cmp < 0;
+    auto next = [&](std::string_view name, const DirEntry& e) {
+      if (name.size() > n)
+        return static_cast<int>(static_cast<unsigned char>(name[n]));
+      return e.is_dir ? '/' : -1;
+    };
+    return next(x, a) < next(y, b);
+  };
+  if (order == SORT_PATH) {
+    std::sort(entries.begin(), entries.end(), path_less);
+    return;
+  }
+  std::sort(entries.begin(), entries.end(),
+            [&](const DirEntry& a, const DirEntry& b) {
+              if (a.is_dir != b.is_dir)
+                return b.is_dir;
+              if (!a.is_dir && order == SORT_SIZE && a.size != b.size)
+                return a.size < b.size;
+              if (!a.is_dir && order == SORT_MTIME &&
+                  (a.mtime_sec != b.mtime_sec ||
+                   a.mtime_nsec != b.mtime_nsec)) {
+                return a.mtime_sec != b.mtime_sec
+                           ? a.mtime_sec < b.mtime_sec
+                           : a.mtime_nsec < b.mtime_nsec;
+              }
+              return path_less(a, b);
+            });
+}
+
+// What --serve keeps between requests, per directory: the listing, its
+// .gitignore rules, other ignore files and file contents. Every directory
+// used gets an inotify watch, added through its open descriptor, and the
+// watch descriptor is the key, so a directory is recognised by identity
+// whichever path a request reaches it by. Any event on a child drops the
+// listing and that child's data; contents beyond the byte budget are
+// dropped wholesale and refilled. A file's content is also keyed by its
+// device, inode and mtime, which catches writes through a hard link in
+// another directory.
+class ServeCache {
+ public:
+  struct CachedFile {
+    std::string content;
+    int64_t mtime;
+    int64_t mtime_nsec = 0;
+    dev_t dev = 0;
+    ino_t ino = 0;
+  };
+
+  struct Dir {
+    bool listed = false;
+    std::string names;
+    std::vector<DirEntry> entries;
+    bool gitignore_loaded = false;
+    std::shared_ptr<const IgnoreRules> gitignore;
+    std::unordered_map<std::string, CachedFile> files;
+    std::unordered_map<std::string, std::shared_ptr<const IgnoreRules>>
+        ignore_files;
+  };
+
+  explicit ServeCache(uint64_t max_bytes)
+      : inotify_fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+        max_bytes_(max_bytes) {}
+
+  ServeCache(const ServeCache&) = delete;
+  ServeCache& operator=(const ServeCache&) = delete;
+
+  ~ServeCache() {
+    if (inotify_fd_ >= 0)
+      close(inotify_fd_);
+  }
+
+  bool ok() const { return inotify_fd_ >= 0; }
+
+  // The entry for an open directory, or nullptr if it cannot be watched.
+  Dir* dir(int dir_fd) {
+    char proc_path[32];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", dir_fd);
+    return watch(proc_path);
+  }
+
+  Dir* dir(const std::string& path) { return watch(path.c_str()); }
+
+  bool has_file(const Dir& dir, const char* name) const {
+    return dir.files.count(name) != 0;
+  }
+
+  // The cached content of `name`, if it is still that of the file `st`
+  // describes.
+  const CachedFile* find_file(const Dir& dir,
+                              const char* name,
+                              const struct stat& st) const {
+    auto it = dir.files.find(name);
+    if (it == dir.files.end())
+      return nullptr;
+    const CachedFile& file = it->second;
+    if (file.dev != st.st_dev || file.ino != st.st_ino ||
+        file.mtime != st.st_mtim.tv_sec ||
+        file.mtime_nsec != st.st_mtim.tv_nsec ||
+        file.content.size() != static_cast<uint64_t>(st.st_size))
+      return nullptr;
+    return &file;
+  }
+
+  // Takes over `content` and returns the stored copy, or returns nullptr
+  // and leaves `content` alone if the file by itself exceeds the budget.
+  const CachedFile* store_file(Dir& dir,
+                               const char* name,
+                               std::string& content,
+                               const struct stat& st) {
+    if (content.size() > max_bytes_)
+      return nullptr;
+    if (bytes_ + content.size() > max_bytes_)
+      drop_files();
+    CachedFile& file = dir.files[name];
+    bytes_ -= file.content.size();
+    bytes_ += content.size();
+    file.content.swap(content);
+    file.mtime = st.st_mtim.tv_sec;
+    file.mtime_nsec = st.st_mtim.tv_nsec;
+    file.dev = st.st_dev;
+    file.ino = st.st_ino;
+    return &file;
+  }
+
+  // Applies pending change notifications. Called before every request,
+  // so entries handed out during a request stay valid until it ends.
+  void sync() {
+    alignas(struct inotify_event) char buf[1 << 16];
+    while (true) {
+      ssize_t n = read(inotify_fd_, buf, sizeof(buf));
+      if (n <= 0)
+        break;
+      for (char* p = buf; p < buf + n;) {
+        auto* event = reinterpret_cast<struct inotify_event*>(p);
+        p += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          dirs_.clear();
+          bytes_ = 0;
+          continue;
+        }
+        auto it = dirs_.find(event->wd);
+        if (it == dirs_.end())
+          continue;
+        if (event->mask & IN_IGNORED) {
+          drop_dir(it);
+          continue;
+        }
+        Dir& dir = it->second;
+        dir.listed = false;
+        std::string().swap(dir.names);
+        std::vector<DirEntry>().swap(dir.entries);
+        if (!event->len)
+          continue;
+        std::string name = event->name;
+        auto file = dir.files.find(name);
+        if (file != dir.files.end()) {
+          bytes_ -= file->second.content.size();
+          dir.files.erase(file);
+        }
+        dir.ignore_files.erase(name);
+        if (name == ".gitignore") {
+          dir.gitignore_loaded = false;
+          dir.gitignore.reset();
+        }
+      }
+    }
+  }
+
+ private:
+  static const uint32_t kWatchMask =
+      IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM |
+      IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR;
+
+  Dir* watch(const char* path) {
+    int wd = inotify_add_watch(inotify_fd_, path, kWatchMask);
+    return wd < 0 ? nullptr : &dirs_[wd];
+  }
+
+  void drop_dir(std::unordered_map<int, Dir>::iterator it) {
+    for (const auto& file : it->second.files)
+      bytes_ -= file.second.content.size();
+    dirs_.erase(it);
+  }
+
+  void drop_files() {
+    for (auto& dir : dirs_)
+      dir.second.files.clear();
+    bytes_ = 0;
+  }
+
+  int inotify_fd_;
+  uint64_t max_bytes_;
+  uint64_t bytes_ = 0;
+  std::unordered_map<int, Dir> dirs_;
+};
+
+// Like process_file, but through the --serve cache. Whole files are
+// cached and the content caps applied to a copy, since they vary between
+// requests. Symlinks are read but never cached: the directory watch only
+// sees changes to the link, not to its target.
+static void process_cached_file(ServeCache::Dir& dir,
+                                int dir_fd,
+                                const char* name,
+                                const std::string& path,
+                                const Opt& opt,
+                                FILE* writer) {
+  struct stat st;
+  if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    printe("Warning: Skipping file %s due to error opening file\n",
+           path.c_str());
+    return;
+  }
+  bool cacheable = S_ISREG(st.st_mode);
+  const ServeCache::CachedFile* file =
+      cacheable ? serve_cache->find_file(dir, name, st) : nullptr;
+  ServeCache::CachedFile uncached;
+  if (!file) {
+    // Without O_NONBLOCK, opening a FIFO would hang the daemon.
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0)
+        close(fd);
+      printe("Warning: Skipping file %s due to error opening file\n",
+             path.c_str());
+      return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+      close(fd);
+      printe("Warning: Skipping file %s due to unsupported file type\n",
+             path.c_str());
+      return;
+    }
+    uncached.content.resize(st.st_size);
+    uncached.mtime = st.st_mtime;
+    bool ok = pread_fully(fd, &uncached.content[0], st.st_size, 0);
+    close(fd);
+    if (!ok) {
+      printe("Warning: Skipping file %s due to error reading file\n",
+             path.c_str());
+      return;
+    }
+    if (cacheable)
+      file = serve_cache->store_file(dir, name, uncached.content, st);
+    if (!file)
+      file = &uncached;
+  }
+  std::string content = file->content;
+  cap_content(content, opt);
+  emit_document(writer, path, content, opt, file->mtime);
+}
+
+// Directory descriptors the walk keeps open, one per level, so that every
+// child is opened with a single lookup relative to its parent. Deeper than
+// this, a directory closes its descriptor while it recurses and reopens it
+// by path afterwards. A low RLIMIT_NOFILE lowers the budget to leave room
+// for the files being read and the output.
+static int dir_fd_budget() {
+  static const int budget = [] {
+    const int kMaxDirFds = 64;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 ||
+        limit.rlim_cur == RLIM_INFINITY)
+      return kMaxDirFds;
+    return static_cast<int>(
+        std::max<rlim_t>(1, std::min<rlim_t>(kMaxDirFds, limit.rlim_cur / 2)));
+  }();
+  return budget;
+}
+
+// `path` is one buffer shared by the whole walk: each level appends its
+// entries' names after its own prefix and truncates back, so full paths
+// are only written out for directories entered and files emitted.
+static void walk_directory(int dir_fd,
+                           std::string& path,
+                           const Opt& opt,
+                           IgnoreStack& ignores,
+                           FILE* writer,
+                           int depth) {
+  // The watch is in place before the listing is read, so no change made
+  // after reading can go unnoticed.
+  ServeCache::Dir* cached = serve_cache ? serve_cache->dir(dir_fd) : nullptr;
+  std::string names;
+  std::vector<DirEntry> entries;
+  if (cached && cached->listed) {
+    names = cached->names;
+    entries = cached->entries;
+  } else {
+    if (!read_dir_entries(dir_fd, path, opt, names, entries)) {
+      close(dir_fd);
+      return;
+    }
+    if (cached) {
+      cached->names = names;
+      cached->entries = entries;
+      cached->listed = true;
+    }
+  }
+  if (opt.sort != SORT_NONE)
+    sort_dir_entries(names, entries, opt.sort);
+
+  if (path.back() != '/')
+    path += '/';
+  size_t prefix_len = path.size();
+  auto name_of = [&](const DirEntry& entry) {
+    return names.c_str() + entry.name_offset;
+  };
+  auto set_path = [&](const DirEntry& entry) {
+    path.resize(prefix_len);
+    path.append(name_of(entry), entry.name_len);
+  };
+  // Without a descriptor, fall back to the full path set by set_path.
+  std::string full_path;
+  auto at_name = [&](const DirEntry& entry) -> const char* {
+    if (dir_fd >= 0)
+      return name_of(entry);
+    full_path = resolve_path(path);
+    return full_path.c_str();
+  };
+
+  bool has_gitignore = false;
+  if (!opt.ignore_gitignore) {
+    for (const auto& entry : entries)
+      has_gitignore |= !entry.is_dir && !strcmp(name_of(entry), ".gitignore");
+  }
+  if (has_gitignore) {
+    std::shared_ptr<const IgnoreRules> rules;
+    if (cached && cached->gitignore_loaded) {
+      rules = cached->gitignore;
+    } else {
+      path += ".gitignore";
+      rules = read_gitignore(dir_fd >= 0 ? dir_fd : AT_FDCWD,
+                             dir_fd >= 0 ? ".gitignore"
+                                         : resolve_path(path).c_str());
+      if (cached) {
+        cached->gitignore = rules;
+        cached->gitignore_loaded = true;
+      }
+    }
+    has_gitignore = rules != nullptr;
+    if (has_gitignore)
+      ignores.push(std::move(rules), prefix_len);
+  }
+
+  auto selected = [&](const DirEntry& entry) {
+    if (opt.has_stat_filters() &&
+        !opt.passes_stat_filters(entry.size, entry.mtime_sec))
+      return false;
+    if (should_ignore_file(name_of(entry), opt.ignore_globs.get(),
+                           opt.extensions, opt.include_hidden))
+      return false;
+    if (opt.ignore_gitignore)
+      return true;
+    set_path(entry);
+    return !ignores.ignored(path, prefix_len, false);
+  };
+
+  // Files are filtered up front so that, while one is read, the next
+  // opt.prefetch files of this directory are already being fetched.
+  std::vector<bool> wanted(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i)
+    wanted[i] = !entries[i].is_dir && selected(entries[i]);
+  size_t ahead = 0, in_flight = 0;
+
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const DirEntry& entry = entries[i];
+    int at_fd = dir_fd >= 0 ? dir_fd : AT_FDCWD;
+    if (entry.is_dir) {
+      // A directory's mtime only moves when entries are added or removed,
+      // so pruning on it is a hint the user has to ask for. So is pruning
+      // directories whose name matches an --ignore glob.
+      if (opt.prune_dirs &&
+          (entry.mtime_sec < opt.newer_than ||
+           (opt.ignore_globs &&
+            opt.ignore_globs->matches(name_of(entry)))))
+        continue;
+      set_path(entry);
+      // Like git, never look inside a repository's own metadata.
+      if (!opt.ignore_gitignore &&
+          (!strcmp(name_of(entry), ".git") ||
+           ignores.ignored(path, prefix_len, true)))
+        continue;
+      int child_fd = openat(at_fd, at_name(entry),
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (child_fd < 0) {
+        printe("Warning: Skipping directory %s due to error opening it\n",
+               path.c_str());
+        continue;
+      }
+      bool release = dir_fd >= 0 && depth >= dir_fd_budget();
+      if (release) {
+        close(dir_fd);
+        dir_fd = -1;
+      }
+      walk_directory(child_fd, path, opt, ignores, writer, depth + 1);
+      if (release) {
+        path.resize(prefix_len);
+        dir_fd = open(resolve_path(path).c_str(),
+                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      }
+      continue;
+    }
+    if (!wanted[i])
+      continue;
+
+    if (ahead <= i) {
+      ahead = i + 1;
+      in_flight = 0;
+    } else {
+      --in_flight;
+    }
+    for (; ahead < entries.size() && in_flight < opt.prefetch; ++ahead) {
+      if (!wanted[ahead])
+        continue;
+      ++in_flight;
+      if (cached && serve_cache->has_file(*cached, name_of(entries[ahead])))
+        continue;
+      set_path(entries[ahead]);
+      prefetch_file(at_fd, at_name(entries[ahead]), opt);
+    }
+
+    set_path(entry);
+    if (cached)
+      process_cached_file(*cached, at_fd, at_name(entry), path, opt, writer);
+    else
+      process_file(at_fd, at_name(entry), path, opt, writer);
+  }
+  if (has_gitignore)
+    ignores.pop();
+  if (dir_fd >= 0)
+    close(dir_fd);
+}
+
+// Read-only access to a git object database: loose objects, packfiles
+// (v1/v2 index, OFS/REF deltas) and alternates. Used by --git-rev to
+// produce a prompt for any revision without checking it out.
+typedef std::array<unsigned char, 20> GitOid;
+
+struct GitOidHash {
+  size_t operator()(const GitOid& oid) const {
+    size_t h;
+    memcpy(&h, oid.data(), sizeof(h));
+    return h;
+  }
+};
+
+enum GitObjectType {
+  GIT_OBJ_NONE = 0,
+  GIT_OBJ_COMMIT = 1,
+  GIT_OBJ_TREE = 2,
+  GIT_OBJ_BLOB = 3,
+  GIT_OBJ_TAG = 4,
+  GIT_OBJ_OFS_DELTA = 6,
+  GIT_OBJ_REF_DELTA = 7,
+};
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static bool is_hex_string(const std::string& s) {
+  for (char c : s) {
+    if (hex_value(c) < 0)
+      return false;
+  }
+  return !s.empty();
+}
+
+static bool parse_oid(const char* hex, GitOid& oid) {
+  for (size_t i = 0; i < oid.size(); i++) {
+    int hi = hex_value(hex[2 * i]);
+    int lo = hi < 0 ? -1 : hex_value(hex[2 * i + 1]);
+    if (lo < 0)
+      return false;
+    oid[i] = (hi << 4) | lo;
+  }
+  return true;
+}
+
+static std::string oid_to_hex(const GitOid& oid) {
+  static const char digits[] = "0123456789abcdef";
+  std::string hex(oid.size() * 2, '0');
+  for (size_t i = 0; i < oid.size(); i++) {
+    hex[2 * i] = digits[oid[i] >> 4];
+    hex[2 * i + 1] = digits[oid[i] & 15];
+  }
+  return hex;
+}
+
+static uint32_t read_be32(const unsigned char* p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+         (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static std::string trim_line(std::string line) {
+  while (!line.empty() && (line.back() == '\n' || line.back() == '\r' ||
+                           line.back() == ' ')) {
+    line.pop_back();
+  }
+  return line;
+}
+
+static bool read_small_file(const std::string& path, std::string& out) {
+  FILE_ptr file(fopen(resolve_path(path).c_str(), "rb"));
+  if (!file)
+    return false;
+  out.clear();
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file.get())) > 0) {
+    out.append(buffer, n);
+  }
+  return true;
+}
+
+// Inflates a zlib stream. When expected_size is known the output is sized
+// up front, otherwise it grows as needed.
+static bool inflate_buffer(const unsigned char* in,
+                           size_t in_len,
+                           size_t expected_size,
+                           std::string& out) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK)
+    return false;
+
+  out.resize(expected_size ? expected_size : 4096);
+  zs.next_in = const_cast<unsigned char*>(in);
+  zs.avail_in = in_len > UINT32_MAX ? UINT32_MAX : in_len;
+  size_t produced = 0;
+  int ret = Z_OK;
+  while (ret == Z_OK) {
+    if (produced == out.size()) {
+      out.resize(out.size() * 2 + 1);
+    }
+    zs.next_out = reinterpret_cast<unsigned char*>(&out[produced]);
+    zs.avail_out = out.size() - produced;
+    ret = inflate(&zs, Z_NO_FLUSH);
+    produced = out.size() - zs.avail_out;
+    if (ret == Z_BUF_ERROR && zs.avail_out != 0)
+      break;
+    if (ret == Z_BUF_ERROR)
+      ret = Z_OK;
+  }
+  inflateEnd(&zs);
+  out.resize(produced);
+  return ret == Z_STREAM_END;
+}
+
+// Applies a git delta (as found in OFS_DELTA/REF_DELTA pack entries) to
+// base, writing the reconstructed object into out.
+static bool apply_delta(const std::string& base,
+                        const std::string& delta,
+                        std::string& out) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(delta.data());
+  const unsigned char* end = p + delta.size();
+  auto read_size = [&](uint64_t& size) {
+    size = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+      if (p == end)
+        return false;
+      c = *p++;
+      size |= uint64_t(c & 0x7f) << shift;
+      shift += 7;
+    } while (c & 0x80);
+    return true;
+  };
+
+  uint64_t base_size, result_size;
+  if (!read_size(base_size) || !read_size(result_size) ||
+      base_size != base.size()) {
+    return false;
+  }
+
+  out.clear();
+  out.reserve(result_size);
+  while (p < end) {
+    unsigned char op = *p++;
+    if (op & 0x80) {
+      uint64_t offset = 0, size = 0;
+      for (int i = 0; i < 4; i++) {
+        if (op & (1 << i)) {
+          if (p == end)
+            return false;
+          offset |= uint64_t(*p++) << (8 * i);
+        }
+      }
+      for (int i = 0; i < 3; i++) {
+        if (op & (0x10 << i)) {
+          if (p == end)
+            return false;
+          size |= uint64_t(*p++) << (8 * i);
+        }
+      }
+      if (size == 0)
+        size = 0x10000;
+      if (offset + size > base.size())
+        return false;
+      out.append(base, offset, size);
+    } else if (op) {
+      if (size_t(end - p) < op)
+        return false;
+      out.append(reinterpret_cast<const char*>(p), op);
+      p += op;
+    } else {
+      return false;
+    }
+  }
+  return out.size() == result_size;
+}
+
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() {
+    if (data_)
+      munmap(data_, size_);
+  }
+
+  bool open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        data_ = p;
+        size_ = st.st_size;
+      }
+    }
+    close(fd);
+    return data_ != nullptr;
+  }
+
+  const unsigned char* data() const {
+    return static_cast<const unsigned char*>(data_);
+  }
+  size_t size() const { return size_; }
+
+ private:
+  void* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+class GitPack {
+ public:
+  bool open(const std::string& idx_path) {
+    std::string pack_path =
+        idx_path.substr(0, idx_path.size() - strlen(".idx")) + ".pack";
+    if (!idx_.open(idx_path) || !pack_.open(pack_path))
+      return false;
+
+    const unsigned char* p = idx_.data();
+    size_t header = 0;
+    if (idx_.size() >= 8 && memcmp(p, "\377tOc", 4) == 0) {
+      if (read_be32(p + 4) != 2)
+        return false;
+      version_ = 2;
+      header = 8;
+    } else {
+      version_ = 1;
+    }
+    if (idx_.size() < header + 256 * 4)
+      return false;
+    fanout_ = p + header;
+    count_ = read_be32(fanout_ + 255 * 4);
+
+    size_t needed;
+    if (version_ == 2) {
+      oids_ = fanout_ + 256 * 4;
+      offsets_ = oids_ + size_t(count_) * (20 + 4);
+      large_offsets_ = offsets_ + size_t(count_) * 4;
+      needed = large_offsets_ - p;
+    } else {
+      oids_ = fanout_ + 256 * 4 + 4;
+      needed = 256 * 4 + size_t(count_) * 24;
+    }
+    return idx_.size() >= needed && pack_.size() >= 12 &&
+           memcmp(pack_.data(), "PACK", 4) == 0;
+  }
+
+  // Binary search of the sorted object table, narrowed by the fanout.
+  bool find(const GitOid& oid, uint64_t& offset) const {
+    uint32_t lo = oid[0] ? read_be32(fanout_ + (oid[0] - 1) * 4) : 0;
+    uint32_t hi = read_be32(fanout_ + oid[0] * 4);
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      int cmp = memcmp(oid_at(mid), oid.data(), 20);
+      if (cmp == 0) {
+        offset = offset_at(mid);
+        return true;
+      }
+      if (cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return false;
+  }
+
+  // Collects up to two objects whose hex name starts with prefix; two is
+  // enough to tell the caller the abbreviation is ambiguous.
+  void find_prefix(const std::string& prefix,
+                   std::vector<GitOid>& matches) const {
+    GitOid low{};
+    for (size_t i = 0; i < prefix.size(); i++) {
+      int v = hex_value(prefix[i]);
+      low[i / 2] |= (i % 2) ? v : v << 4;
+    }
+    uint32_t lo = low[0] ? read_be32(fanout_ + (low[0] - 1) * 4) : 0;
+    uint32_t hi = read_be32(fanout_ + low[0] * 4);
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (memcmp(oid_at(mid), low.data(), 20) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    for (uint32_t i = lo; i < count_ && matches.size() < 2; i++) {
+      GitOid oid;
+      memcpy(oid.data(), oid_at(i), 20);
+      if (oid_to_hex(oid).compare(0, prefix.size(), prefix) != 0)
+        break;
+      if (std::find(matches.begin(), matches.end(), oid) == matches.end())
+        matches.push_back(oid);
+    }
+  }
+
+  const unsigned char* data() const { return pack_.data(); }
+  size_t size() const { return pack_.size(); }
+
+ private:
+  const unsigned char* oid_at(uint32_t i) const {
+    return version_ == 2 ? oids_ + size_t(i) * 20 : oids_ + size_t(i) * 24;
+  }
+
+  uint64_t offset_at(uint32_t i) const {
+    if (version_ == 1)
+      return read_be32(oids_ + size_t(i) * 24 - 4);
+    uint32_t off = read_be32(offsets_ + size_t(i) * 4);
+    if (!(off & 0x80000000u))
+      return off;
+    const unsigned char* p = large_offsets_ + size_t(off & 0x7fffffffu) * 8;
+    if (p + 8 > idx_.data() + idx_.size())
+      return 0;
+    return (uint64_t(read_be32(p)) << 32) | read_be32(p + 4);
+  }
+
+  MappedFile idx_;
+  MappedFile pack_;
+  int version_ = 0;
+  uint32_t count_ = 0;
+  const unsigned char* fanout_ = nullptr;
+  const unsigned char* oids_ = nullptr;
+  const unsigned char* offsets_ = nullptr;
+  const unsigned char* large_offsets_ = nullptr;
+};
+
+// Least-recently-used cache of inflated pack objects, keyed by pack and
+// offset. Delta chains share bases heavily, so keeping recent bases around
+// avoids re-inflating the same chain prefix for every blob.
+class DeltaBaseCache {
+ public:
+  explicit DeltaBaseCache(size_t limit) : limit_(limit) {}
+
+  const std::string* get(uint64_t key, int& type) {
+    auto it = map_.find(key);
+    if (it == map_.end())
+      return nullptr;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    type = it->second->type;
+    return &it->second->data;
+  }
+
+  void put(uint64_t key, int type, const std::string& data) {
+    if (data.size() > limit_ / 4 || map_.count(key))
+      return;
+    lru_.push_front(Entry{key, type, data});
+    map_[key] = lru_.begin();
+    size_ += data.size();
+    while (size_ > limit_) {
+      size_ -= lru_.back().data.size();
+      map_.erase(lru_.back().key);
+      lru_.pop_back();
+    }
+  }
+
+ private:
+  struct Entry {
+    uint64_t key;
+    int type;
+    std::string data;
+  };
+
+  size_t limit_;
+  size_t size_ = 0;
+  std::list<Entry> lru_;
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> map_;
+};
+
+class GitRepo {
+ public:
+  bool open(const std::string& start) {
+    if (!locate(start))
+      return false;
+    add_object_dir(common_dir_ + "/objects", 0);
+    return !object_dirs_.empty();
+  }
+
+  // Locates the repository the way git does, without loading anything:
+  // $GIT_DIR, then a .git directory or gitfile in start or any parent,
+  // then start itself as a bare repository.
+  bool locate(const std::string& start) {
+    const char* env = getenv("GIT_DIR");
+    if (env && *env) {
+      git_dir_ = env;
+      const char* work_tree = getenv("GIT_WORK_TREE");
+      work_tree_ = work_tree && *work_tree ? work_tree : ".";
+    } else {
+      std::error_code ec;
+      fs::path dir = fs::absolute(resolve_path(start), ec).lexically_normal();
+      if (dir.filename().empty())
+        dir = dir.parent_path();
+      for (; !dir.empty(); dir = dir.parent_path()) {
+        fs::path dot_git = dir / ".git";
+        if (fs::is_directory(dot_git, ec)) {
+          git_dir_ = dot_git.string();
+          work_tree_ = dir.string();
+          break;
+        }
+        std::string gitfile;
+        if (fs::is_regular_file(dot_git, ec) &&
+            read_small_file(dot_git.string(), gitfile) &&
+            gitfile.compare(0, 8, "gitdir: ") == 0) {
+          fs::path target = trim_line(gitfile.substr(8));
+          git_dir_ = (target.is_relative() ? dir / target : target).string();
+          work_tree_ = dir.string();
+          break;
+        }
+        if (fs::is_regular_file(dir / "HEAD", ec) &&
+            fs::is_directory(dir / "objects", ec) &&
+            fs::is_directory(dir / "refs", ec)) {
+          git_dir_ = dir.string();
+          break;
+        }
+        if (dir == dir.parent_path())
+          break;
+      }
+    }
+    if (git_dir_.empty())
+      return false;
+
+    common_dir_ = git_dir_;
+    std::string commondir;
+    if (read_small_file(git_dir_ + "/commondir", commondir)) {
+      fs::path target = trim_line(commondir);
+      common_dir_ = (target.is_relative() ? fs::path(git_dir_) / target
+                                          : target)
+                        .string();
+    }
+    return true;
+  }
+
+  // Resolves a revision: full or abbreviated object names, refs (with the
+  // usual refs/, refs/tags/, refs/heads/, refs/remotes/ search order),
+  // followed by any number of ~N, ^N and ^{type} suffixes.
+  bool resolve(const std::string& rev, GitOid& oid) {
+    size_t op = rev.find_first_of("~^");
+    std::string base = rev.substr(0, op);
+    if (!resolve_name(base.empty() ? "HEAD" : base, oid))
+      return false;
+
+    while (op != std::string::npos && op < rev.size()) {
+      char kind = rev[op++];
+      if (kind == '^' && op < rev.size() && rev[op] == '{') {
+        size_t close = rev.find('}', op);
+        if (close == std::string::npos)
+          return false;
+        std::string want = rev.substr(op + 1, close - op - 1);
+        op = close + 1;
+        int type = want == "tree"     ? GIT_OBJ_TREE
+                   : want == "commit" ? GIT_OBJ_COMMIT
+                   : want == "blob"   ? GIT_OBJ_BLOB
+                                      : GIT_OBJ_NONE;
+        if (!peel(oid, type))
+          return false;
+        continue;
+      }
+
+      size_t digits_end = op;
+      while (digits_end < rev.size() && isdigit(rev[digits_end]))
+        digits_end++;
+      long n = digits_end > op ? atol(rev.substr(op, digits_end - op).c_str())
+                               : 1;
+      op = digits_end;
+      if (!peel(oid, GIT_OBJ_COMMIT))
+        return false;
+      if (kind == '^') {
+        if (n > 0 && !commit_parent(oid, n, oid))
+          return false;
+      } else {
+        for (long i = 0; i < n; i++) {
+          if (!commit_parent(oid, 1, oid))
+            return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Follows tags and commits until an object of the wanted type is reached;
+  // GIT_OBJ_NONE peels tags only, as ^{} does.
+  bool peel(GitOid& oid, int want) {
+    for (int depth = 0; depth < 64; depth++) {
+      int type;
+      std::string data;
+      if (!read_object(oid, type, data))
+        return false;
+      if (type == want || (want == GIT_OBJ_NONE && type != GIT_OBJ_TAG))
+        return true;
+      const char* field = type == GIT_OBJ_TAG      ? "object "
+                          : type == GIT_OBJ_COMMIT ? "tree "
+                                                   : nullptr;
+      if (!field || data.compare(0, strlen(field), field) != 0 ||
+          !parse_oid(data.c_str() + strlen(field), oid)) {
+        return false;
+      }
+    }
+    return false;
+  }
+
+  const std::string& git_dir() const { return git_dir_; }
+
+  // Top of the working tree, or empty for a bare repository.
+  const std::string& work_tree() const { return work_tree_; }
+
+  // Where shared state lives: info/, config and objects. Differs from
+  // git_dir() in linked worktrees.
+  const std::string& common_dir() const { return common_dir_; }
+
+  bool read_object(const GitOid& oid, int& type, std::string& data) {
+    for (size_t i = 0; i < packs_.size(); i++) {
+      uint64_t offset;
+      if (packs_[i]->find(oid, offset))
+        return read_packed(i, offset, type, data);
+    }
+    for (const auto& dir : object_dirs_) {
+      if (read_loose(dir, oid, type, data))
+        return true;
+    }
+    return false;
+  }
+
+ private:
+  void add_object_dir(const std::string& dir, int depth) {
+    std::error_code ec;
+    if (depth > 5 || !fs::is_directory(dir, ec))
+      return;
+    object_dirs_.push_back(dir);
+    for (const auto& entry : fs::directory_iterator(dir + "/pack", ec)) {
+      if (entry.path().extension() != ".idx")
+        continue;
+      std::unique_ptr<GitPack> pack(new GitPack());
+      if (pack->open(entry.path().string())) {
+        packs_.push_back(std::move(pack));
+      } else {
+        printe("Warning: Skipping unreadable pack %s\n",
+               entry.path().c_str());
+      }
+    }
+
+    FILE_ptr alternates(fopen((dir + "/info/alternates").c_str(), "r"));
+    if (alternates) {
+      std::string line;
+      while (getline(line, alternates.get()) != -1) {
+        line = trim_line(line);
+        if (line.empty() || line[0] == '#')
+          continue;
+        fs::path alt = line;
+        add_object_dir((alt.is_relative() ? fs::path(dir) / alt : alt).string(),
+                       depth + 1);
+      }
+    }
+  }
+
+  bool read_loose(const std::string& dir,
+                  const GitOid& oid,
+                  int& type,
+                  std::string& data) {
+    std::string hex = oid_to_hex(oid);
+    MappedFile file;
+    if (!file.open(dir + "/" + hex.substr(0, 2) + "/" + hex.substr(2)))
+      return false;
+    std::string raw;
+    inflate_buffer(file.data(), file.size(), 0, raw);
+    size_t nul = raw.find('\0');
+    size_t space = raw.find(' ');
+    if (nul == std::string::npos || space > nul)
+      return false;
+    std::string name = raw.substr(0, space);
+    type = name == "commit" ? GIT_OBJ_COMMIT
+           : name == "tree" ? GIT_OBJ_TREE
+           : name == "blob" ? GIT_OBJ_BLOB
+           : name == "tag"  ? GIT_OBJ_TAG
+                            : GIT_OBJ_NONE;
+    data = raw.substr(nul + 1);
+    return type != GIT_OBJ_NONE &&
+           data.size() == strtoull(raw.c_str() + space + 1, nullptr, 10);
+  }
+
+  struct PackEntry {
+    int type;
+    uint64_t size;
+    size_t data_offset;
+    uint64_t base_offset;
+    GitOid base_oid;
+  };
+
+  bool parse_pack_entry(const GitPack& pack, uint64_t offset, PackEntry& e) {
+    const unsigned char* p = pack.data();
+    size_t end = pack.size();
+    size_t i = offset;
+    if (i >= end)
+      return false;
+    unsigned char c = p[i++];
+    e.type = (c >> 4) & 7;
+    e.size = c & 15;
+    int shift = 4;
+    while (c & 0x80) {
+      if (i >= end)
+        return false;
+      c = p[i++];
+      e.size |= uint64_t(c & 0x7f) << shift;
+      shift += 7;
+    }
+
+    if (e.type == GIT_OBJ_OFS_DELTA) {
+      if (i >= end)
+        return false;
+      c = p[i++];
+      uint64_t distance = c & 0x7f;
+      while (c & 0x80) {
+        if (i >= end)
+          return false;
+        c = p[i++];
+        distance = ((distance + 1) << 7) | (c & 0x7f);
+      }
+      if (distance > offset)
+        return false;
+      e.base_offset = offset - distance;
+    } else if (e.type == GIT_OBJ_REF_DELTA) {
+      if (i + 20 > end)
+        return false;
+      memcpy(e.base_oid.data(), p + i, 20);
+      i += 20;
+    }
+    e.data_offset = i;
+    return true;
+  }
+
+  bool inflate_entry(const GitPack& pack,
+                     const PackEntry& e,
+                     std::string& out) {
+    return inflate_buffer(pack.data() + e.data_offset,
+                          pack.size() - e.data_offset, e.size, out) &&
+           out.size() == e.size;
+  }
+
+  // Reconstructs the object at offset: walks the delta chain down to a
+  // cached or undeltified base, then applies the deltas back up, caching
+  // each intermediate result.
+  bool read_packed(size_t pack_index,
+                   uint64_t offset,
+                   int& type,
+                   std::string& data) {
+    const GitPack& pack = *packs_[pack_index];
+    auto cache_key = [&](uint64_t off) {
+      return (uint64_t(pack_index) << 48) | off;
+    };
+
+    std::vector<PackEntry> chain;
+    std::string base;
+    int base_type = GIT_OBJ_NONE;
+    uint64_t off = offset;
+    while (true) {
+      if (const std::string* cached = cache_.get(cache_key(off), base_type)) {
+        base = *cached;
+        break;
+      }
+      PackEntry e;
+      if (!parse_pack_entry(pack, off, e) || chain.size() > 10000)
+        return false;
+      if (e.type == GIT_OBJ_OFS_DELTA) {
+        chain.push_back(e);
+        off = e.base_offset;
+        continue;
+      }
+      if (e.type == GIT_OBJ_REF_DELTA) {
+        chain.push_back(e);
+        if (pack.find(e.base_oid, off))
+          continue;
+        if (!read_object(e.base_oid, base_type, base))
+          return false;
+        break;
+      }
+      if (e.type < GIT_OBJ_COMMIT || e.type > GIT_OBJ_TAG ||
+          !inflate_entry(pack, e, base)) {
+        return false;
+      }
+      base_type = e.type;
+      if (!chain.empty())
+        cache_.put(cache_key(off), base_type, base);
+      break;
+    }
+
+    std::string delta, result;
+    for (size_t i = chain.size(); i-- > 0;) {
+      if (!inflate_entry(pack, chain[i], delta) ||
+          !apply_delta(base, delta, result)) {
+        return false;
+      }
+      base.swap(result);
+      if (i > 0) {
+        uint64_t entry_offset = chain[i - 1].type == GIT_OBJ_OFS_DELTA
+                                    ? chain[i - 1].base_offset
+                                    : 0;
+        if (entry_offset)
+          cache_.put(cache_key(entry_offset), base_type, base);
+      }
+    }
+    type = base_type;
+    data.swap(base);
+    return true;
+  }
+
+  bool read_ref(const std::string& name, GitOid& oid, int depth = 0) {
+    if (depth > 5)
+      return false;
+    std::string content;
+    if (read_small_file(git_dir_ + "/" + name, content) ||
+        read_small_file(common_dir_ + "/" + name, content)) {
+      content = trim_line(content);
+      if (content.compare(0, 5, "ref: ") == 0)
+        return read_ref(content.substr(5), oid, depth + 1);
+      return content.size() >= 40 && parse_oid(content.c_str(), oid);
+    }
+
+    FILE_ptr packed(fopen((common_dir_ + "/packed-refs").c_str(), "r"));
+    if (!packed)
+      return false;
+    std::string line;
+    while (getline(line, packed.get()) != -1) {
+      line = trim_line(line);
+      if (line.size() > 41 && line[40] == ' ' &&
+          line.compare(41, std::string::npos, name) == 0) {
+        return parse_oid(line.c_str(), oid);
+      }
+    }
+    return false;
+  }
+
+  bool resolve_name(const std::string& name, GitOid& oid) {
+    if (name.size() == 40 && parse_oid(name.c_str(), oid))
+      return true;
+
+    static const char* const rules[] = {
+        "%s",         "refs/%s",         "refs/tags/%s",
+        "refs/heads/%s", "refs/remotes/%s", "refs/remotes/%s/HEAD",
+    };
+    for (const char* rule : rules) {
+      std::string ref = rule;
+      ref.replace(ref.find("%s"), 2, name);
+      if (read_ref(ref, oid))
+        return true;
+    }
+
+    if (name.size() < 4 || name.size() > 40 || !is_hex_string(name))
+      return false;
+    std::string prefix = name;
+    std::transform(prefix.begin(), prefix.end(), prefix.begin(), ::tolower);
+    std::vector<GitOid> matches;
+    for (const auto& pack : packs_)
+      pack->find_prefix(prefix, matches);
+    std::error_code ec;
+    for (const auto& dir : object_dirs_) {
+      for (const auto& entry :
+           fs::directory_iterator(dir + "/" + prefix.substr(0, 2), ec)) {
+        std::string hex = prefix.substr(0, 2) + entry.path().filename().string();
+        GitOid candidate;
+        if (hex.size() == 40 && hex.compare(0, prefix.size(), prefix) == 0 &&
+            parse_oid(hex.c_str(), candidate) &&
+            std::find(matches.begin(), matches.end(), candidate) ==
+                matches.end()) {
+          matches.push_back(candidate);
+        }
+      }
+    }
+    if (matches.size() > 1) {
+      printe("Short object name %s is ambiguous\n", name.c_str());
+      return false;
+    }
+    if (matches.empty())
+      return false;
+    oid = matches[0];
+    return true;
+  }
+
+  bool commit_parent(const GitOid& commit, long n, GitOid& parent) {
+    int type;
+    std::string data;
+    if (!read_object(commit, type, data) || type != GIT_OBJ_COMMIT)
+      return false;
+    size_t pos = 0;
+    while ((pos = data.find("\nparent ", pos)) != std::string::npos) {
+      pos += strlen("\nparent ");
+      if (--n == 0)
+        return parse_oid(data.c_str() + pos, parent);
+    }
+    return false;
+  }
+
+  std::string git_dir_;
+  std::string common_dir_;
+  std::string work_tree_;
+  std::vector<std::string> object_dirs_;
+  std::vector<std::unique_ptr<GitPack>> packs_;
+  DeltaBaseCache cache_{64 << 20};
+};
+
+struct GitTreeEntry {
+  unsigned mode;
+  std::string name;
+  GitOid oid;
+};
+
+static bool parse_tree(const std::string& data,
+                       std::vector<GitTreeEntry>& entries) {
+  entries.clear();
+  size_t pos = 0;
+  while (pos < data.size()) {
+    size_t space = data.find(' ', pos);
+    size_t nul = data.find('\0', space);
+    if (space == std::string::npos || nul == std::string::npos ||
+        nul + 21 > data.size()) {
+      return false;
+    }
+    GitTreeEntry entry;
+    entry.mode = strtoul(data.c_str() + pos, nullptr, 8);
+    entry.name = data.substr(space + 1, nul - space - 1);
+    memcpy(entry.oid.data(), data.data() + nul + 1, 20);
+    entries.push_back(std::move(entry));
+    pos = nul + 21;
+  }
+  return true;
+}
+
+static void process_git_tree(GitRepo& repo,
+                             const GitOid& tree,
+                             const std::string& prefix,
+                             const Opt& opt,
+                             FILE* writer) {
+  int type;
+  std::string data;
+  std::vector<GitTreeEntry> entries;
+  if (!repo.read_object(tree, type, data) || type != GIT_OBJ_TREE ||
+      !parse_tree(data, entries)) {
+    printe("Warning: Skipping unreadable tree %s\n", prefix.c_str());
+    return;
+  }
+
+  for (const auto& entry : entries) {
+    std::string path = prefix.empty() ? entry.name : prefix + "/" + entry.name;
+    if ((entry.mode & 0170000) == 0040000) {
+      process_git_tree(repo, entry.oid, path, opt, writer);
+      continue;
+    }
+    // Symlinks and submodules have no content in this repository.
+    if ((entry.mode & 0170000) != 0100000)
+      continue;
+    if (should_ignore_file(entry.name.c_str(), opt.ignore_globs.get(),
+                           opt.extensions,
+                           opt.include_hidden))
+      continue;
+
+    std::string content;
+    if (!repo.read_object(entry.oid, type, content)) {
+      printe("Warning: Skipping file %s due to error reading object %s\n",
+             path.c_str(), oid_to_hex(entry.oid).c_str());
+      continue;
+    }
+    cap_content(content, opt);
+    emit_document(writer, path, content, opt);
+  }
+}
+
+// Emits the files of a revision. Paths are taken relative to the top of
+// the tree; "." selects the whole tree.
+static int process_git_rev(const Opt& opt, FILE* writer) {
+  GitRepo repo;
+  if (!repo.open(".")) {
+    printe("Not a git repository: %s\n",
+           fs::absolute(resolve_path(".")).lexically_normal().c_str());
+    return 1;
+  }
+  GitOid root;
+  if (!repo.resolve(opt.git_rev, root) || !repo.peel(root, GIT_OBJ_TREE)) {
+    printe("Unknown revision: %s\n", opt.git_rev.c_str());
+    return 1;
+  }
+
+  print_header(writer, opt);
+  for (const auto& path : opt.paths) {
+    std::string rel = fs::path(path).lexically_normal().generic_string();
+    while (!rel.empty() && rel.back() == '/')
+      rel.pop_back();
+    if (rel == ".")
+      rel.clear();
+
+    GitOid oid = root;
+    unsigned mode = 0040000;
+    size_t start = 0;
+    bool found = true;
+    while (found && start < rel.size()) {
+      size_t slash = std::min(rel.find('/', start), rel.size());
+      std::string component = rel.substr(start, slash - start);
+      start = slash + 1;
+
+      int type;
+      std::string data;
+      std::vector<GitTreeEntry> entries;
+      found = (mode & 0170000) == 0040000 && repo.read_object(oid, type, data) &&
+              parse_tree(data, entries);
+      auto it = std::find_if(
+          entries.begin(), entries.end(),
+          [&](const GitTreeEntry& e) { return e.name == component; });
+      found = found && it != entries.end();
+      if (found) {
+        oid = it->oid;
+        mode = it->mode;
+      }
+    }
+    if (!found) {
+      printe("Path does not exist in %s: %s\n", opt.git_rev.c_str(),
+             path.c_str());
+      return 1;
+    }
+
+    if ((mode & 0170000) == 0040000) {
+      process_git_tree(repo, oid, rel, opt, writer);
+      continue;
+    }
+    int type;
+    std::string content;
+    if (repo.read_object(oid, type, content)) {
+      cap_content(content, opt);
+      emit_document(writer, rel, content, opt);
+    }
+  }
+  print_footer(writer, opt);
+  return 0;
+}
+
+struct GitIndexEntry {
+  uint32_t mtime_sec;
+  uint32_t mtime_nsec;
+  uint32_t ino;
+  uint32_t mode;
+  uint32_t size;
+  GitOid oid;
+  bool skip_worktree;
+  std::string path;
+};
+
+// Reads the stage-0 entries of a version 2, 3 or 4 index file.
+// racy_sec receives the index mtime: entries modified in that same second
+// cannot be trusted to be clean from stat data alone.
+static bool read_git_index(const std::string& path,
+                           std::vector<GitIndexEntry>& entries,
+                           uint32_t& racy_sec) {
+  MappedFile file;
+  if (!file.open(path) || file.size() < 12 ||
+      memcmp(file.data(), "DIRC", 4) != 0) {
+    return false;
+  }
+  struct stat st;
+  racy_sec = stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+
+  const unsigned char* p = file.data();
+  const unsigned char* end = p + file.size() - 20;
+  uint32_t version = read_be32(p + 4);
+  uint32_t count = read_be32(p + 8);
+  if (version < 2 || version > 4)
+    return false;
+
+  const unsigned char* cur = p + 12;
+  std::string name;
+  entries.clear();
+  entries.reserve(count);
+  for (uint32_t i = 0; i < count; i++) {
+    const unsigned char* start = cur;
+    if (end - cur < 62)
+      return false;
+    GitIndexEntry entry;
+    entry.mtime_sec = read_be32(cur + 8);
+    entry.mtime_nsec = read_be32(cur + 12);
+    entry.ino = read_be32(cur + 20);
+    entry.mode = read_be32(cur + 24);
+    entry.size = read_be32(cur + 36);
+    memcpy(entry.oid.data(), cur + 40, 20);
+    uint16_t flags = (cur[60] << 8) | cur[61];
+    cur += 62;
+    entry.skip_worktree = false;
+    if (flags & 0x4000) {
+      if (end - cur < 2)
+        return false;
+      entry.skip_worktree = cur[0] & 0x40;
+      cur += 2;
+    }
+
+    if (version == 4) {
+      unsigned char c = *cur++;
+      uint64_t strip = c & 0x7f;
+      while (c & 0x80 && cur < end) {
+        c = *cur++;
+        strip = ((strip + 1) << 7) | (c & 0x7f);
+      }
+      if (strip > name.size())
+        return false;
+      name.resize(name.size() - strip);
+    } else {
+      name.clear();
+    }
+    const unsigned char* nul =
+        static_cast<const unsigned char*>(memchr(cur, '\0', end - cur));
+    if (!nul)
+      return false;
+    name.append(reinterpret_cast<const char*>(cur), nul - cur);
+    cur = nul + 1;
+    if (version != 4) {
+      cur = start + ((cur - start + 7) & ~size_t(7));
+    }
+
+    if ((flags >> 12 & 3) == 0) {
+      entry.path = name;
+      entries.push_back(std::move(entry));
+    }
+  }
+  return true;
+}
+
+static void collect_git_tree(GitRepo& repo,
+                             const GitOid& tree,
+                             const std::string& prefix,
+                             std::unordered_map<std::string, GitOid>& files) {
+  int type;
+  std::string data;
+  std::vector<GitTreeEntry> entries;
+  if (!repo.read_object(tree, type, data) || !parse_tree(data, entries))
+    return;
+  for (const auto& entry : entries) {
+    std::string path = prefix + entry.name;
+    if ((entry.mode & 0170000) == 0040000) {
+      collect_git_tree(repo, entry.oid, path + "/", files);
+    } else {
+      files[path] = entry.oid;
+    }
+  }
+}
+
+// SHA-1, only used to compute the object id of a working tree file whose
+// stat data cannot tell whether it changed.
+class Sha1 {
+ public:
+  void update(const void* data, size_t len) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    total_ += len;
+    if (used_) {
+      size_t n = std::min(len, sizeof(buf_) - used_);
+      memcpy(buf_ + used_, p, n);
+      used_ += n;
+      p += n;
+      len -= n;
+      if (used_ < sizeof(buf_))
+        return;
+      block(buf_);
+      used_ = 0;
+    }
+    for (; len >= sizeof(buf_); p += sizeof(buf_), len -= sizeof(buf_))
+      block(p);
+    memcpy(buf_, p, len);
+    used_ = len;
+  }
+
+  GitOid finish() {
+    uint64_t bits = total_ * 8;
+    unsigned char pad[72] = {0x80};
+    size_t pad_len = (used_ < 56 ? 56 : 120) - used_;
+    for (int i = 0; i < 8; i++)
+      pad[pad_len + i] = bits >> (56 - 8 * i);
+    update(pad, pad_len + 8);
+    GitOid oid;
+    for (int i = 0; i < 20; i++)
+      oid[i] = h_[i / 4] >> (24 - 8 * (i % 4));
+    return oid;
+  }
+
+ private:
+  static uint32_t rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+  void block(const unsigned char* p) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+      w[i] = (p[4 * i] << 24) | (p[4 * i + 1] << 16) | (p[4 * i + 2] << 8) |
+             p[4 * i + 3];
+    for (int i = 16; i < 80; i++)
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    uint32_t a = h_[0], b = h_[1], c = h_[2], d = h_[3], e = h_[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      uint32_t t = rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = t;
+    }
+    h_[0] += a;
+    h_[1] += b;
+    h_[2] += c;
+    h_[3] += d;
+    h_[4] += e;
+  }
+
+  uint32_t h_[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                    0xc3d2e1f0};
+  unsigned char buf_[64];
+  size_t used_ = 0;
+  uint64_t total_ = 0;
+};
+
+// Whether the file at path hashes to the blob id oid.
+static bool file_matches_blob(const std::string& path, const GitOid& oid) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  Sha1 sha1;
+  std::string header = "blob " + std::to_string(st.st_size);
+  sha1.update(header.c_str(), header.size() + 1);
+  uint64_t remaining = st.st_size;
+  char buf[1 << 16];
+  while (remaining > 0) {
+    ssize_t n = read(fd, buf, std::min<uint64_t>(sizeof(buf), remaining));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    sha1.update(buf, n);
+    remaining -= n;
+  }
+  close(fd);
+  return remaining == 0 && sha1.finish() == oid;
+}
+
+static bool index_entry_dirty(const std::string& path,
+                              const GitIndexEntry& entry,
+                              uint32_t racy_sec) {
+#ifdef STATX_BASIC_STATS
+  struct statx stx;
+  if (statx(AT_FDCWD, path.c_str(), AT_SYMLINK_NOFOLLOW,
+            STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME, &stx) != 0) {
+    return true;
+  }
+  uint32_t mode = stx.stx_mode, ino = stx.stx_ino, size = stx.stx_size;
+  uint32_t mtime_sec = stx.stx_mtime.tv_sec;
+  uint32_t mtime_nsec = stx.stx_mtime.tv_nsec;
+#else
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0)
+    return true;
+  uint32_t mode = st.st_mode, ino = st.st_ino, size = st.st_size;
+  uint32_t mtime_sec = st.st_mtim.tv_sec;
+  uint32_t mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+  if ((mode & 0170000) != (entry.mode & 0170000))
+    return true;
+  // A size of 0 in the index may be git's mark for a racily clean entry
+  // it could not verify, so only another real size proves a change.
+  if (size != entry.size && entry.size != 0)
+    return true;
+  // Entries written in the same second as the index are "racily clean":
+  // their stat data may predate a change, so like git, hash them. Files
+  // whose times or inode changed, e.g. by a touch, are hashed too.
+  if (size == entry.size && ino == entry.ino &&
+      mtime_sec == entry.mtime_sec && mtime_nsec == entry.mtime_nsec &&
+      mtime_sec < racy_sec)
+    return false;
+  return !file_matches_blob(path, entry.oid);
+}
+
+// Emits working tree files that differ from the index (--dirty) and/or from
+// a revision (--changed-since). Stat data cached in the index decides
+// whether a file is modified; files are only hashed when it cannot.
+static int process_git_changes(const Opt& opt, FILE* writer) {
+  GitRepo repo;
+  if (!repo.open(".") || repo.work_tree().empty()) {
+    printe("Not a git working tree: %s\n",
+           fs::absolute(resolve_path(".")).lexically_normal().c_str());
+    return 1;
+  }
+
+  std::vector<GitIndexEntry> entries;
+  uint32_t racy_sec;
+  if (!read_git_index(repo.git_dir() + "/index", entries, racy_sec)) {
+    printe("Unable to read git index in %s\n", repo.git_dir().c_str());
+    return 1;
+  }
+
+  bool compare_rev = !opt.changed_since.empty();
+  std::unordered_map<std::string, GitOid> rev_files;
+  if (compare_rev) {
+    GitOid tree;
+    if (!repo.resolve(opt.changed_since, tree) ||
+        !repo.peel(tree, GIT_OBJ_TREE)) {
+      printe("Unknown revision: %s\n", opt.changed_since.c_str());
+      return 1;
+    }
+    collect_git_tree(repo, tree, "", rev_files);
+  }
+
+  // Path arguments are relative to the current directory while index paths
+  // are relative to the top of the work tree; output paths are printed
+  // relative to the current directory again, as git does.
+  std::error_code ec;
+  fs::path cwd = fs::absolute(resolve_path("."), ec).lexically_normal();
+  fs::path top = fs::absolute(repo.work_tree(), ec).lexically_normal();
+  if (top.filename().empty())
+    top = top.parent_path();
+  std::vector<std::string> prefixes;
+  for (const auto& path : opt.paths) {
+    fs::path rel = (cwd / path).lexically_normal().lexically_relative(top);
+    if (rel.empty() || *rel.begin() == "..") {
+      printe("Path %s is outside the work tree %s\n", path.c_str(),
+             top.c_str());
+      return 1;
+    }
+    std::string prefix = rel.generic_string();
+    while (!prefix.empty() && prefix.back() == '/')
+      prefix.pop_back();
+    prefixes.push_back(prefix == "." ? "" : prefix);
+  }
+
+  print_header(writer, opt);
+  for (const auto& entry : entries) {
+    if ((entry.mode & 0170000) != 0100000 || entry.skip_worktree)
+      continue;
+    bool selected = std::any_of(
+        prefixes.begin(), prefixes.end(), [&](const std::string& prefix) {
+          return prefix.empty() || entry.path == prefix ||
+                 (entry.path.compare(0, prefix.size(), prefix) == 0 &&
+                  entry.path[prefix.size()] == '/');
+        });
+    if (!selected)
+      continue;
+    const char* filename = entry.path.c_str() + entry.path.rfind('/') + 1;
+    if (should_ignore_file(filename, opt.ignore_globs.get(), opt.extensions,
+                           opt.include_hidden))
+      continue;
+
+    bool changed = false;
+    if (compare_rev) {
+      auto it = rev_files.find(entry.path);
+      changed = it == rev_files.end() || it->second != entry.oid;
+    }
+    std::string full_path = repo.work_tree() + "/" + entry.path;
+    if (!changed && !index_entry_dirty(full_path, entry, racy_sec))
+      continue;
+    struct stat st;
+    if (stat(full_path.c_str(), &st) != 0)
+      continue;
+    if (opt.has_stat_filters() &&
+        !opt.passes_stat_filters(st.st_size, st.st_mtime))
+      continue;
+
+    int64_t mtime = -1;
+    std::string content = read_file_content(full_path, opt, &mtime);
+    std::string display =
+        (top / entry.path).lexically_relative(cwd).generic_string();
+    emit_document(writer, display, content, opt, mtime);
+  }
+  print_footer(writer, opt);
+  return 0;
+}
+
+// Archive inputs (.tar, .tar.gz, .tgz, .zip) are read in place rather than
+// extracted; their members are filtered and printed as if they lived in a
+// directory named after the archive.
+enum ArchiveKind {
+  ARCHIVE_NONE,
+  ARCHIVE_TAR,
+  ARCHIVE_ZIP,
+};
+
+static bool ends_with(const std::string& s, const char* suffix) {
+  size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+static ArchiveKind archive_kind(const std::string& path) {
+  if (ends_with(path, ".tar") || ends_with(path, ".tar.gz") ||
+      ends_with(path, ".tgz")) {
+    return ARCHIVE_TAR;
+  }
+  if (ends_with(path, ".zip"))
+    return ARCHIVE_ZIP;
+  return ARCHIVE_NONE;
+}
+
+static bool should_ignore_member(const std::string& member, const Opt& opt) {
+  const char* filename = member.c_str() + member.rfind('/') + 1;
+  if (!*filename)
+    return true;
+  return should_ignore_file(filename, opt.ignore_globs.get(), opt.extensions,
+                            opt.include_hidden);
+}
+
+struct GzFileDeleter {
+  void operator()(gzFile file) const {
+    if (file) {
+      gzclose(file);
+    }
+  }
+};
+
+typedef std::unique_ptr<gzFile_s, GzFileDeleter> GzFile_ptr;
+
+static bool gz_read_fully(gzFile file, char* data, uint64_t size) {
+  while (size > 0) {
+    unsigned chunk = size > (1u << 30) ? (1u << 30) : unsigned(size);
+    int n = gzread(file, data, chunk);
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+static uint64_t parse_tar_number(const char* field, size_t len) {
+  // GNU base-256 encoding for values that do not fit in octal.
+  if (static_cast<unsigned char>(field[0]) & 0x80) {
+    uint64_t value = field[0] & 0x3f;
+    for (size_t i = 1; i < len; i++)
+      value = (value << 8) | static_cast<unsigned char>(field[i]);
+    return value;
+  }
+  uint64_t value = 0;
+  for (size_t i = 0; i < len && field[i]; i++) {
+    if (field[i] >= '0' && field[i] <= '7')
+      value = (value << 3) | (field[i] - '0');
+  }
+  return value;
+}
+
+static std::string tar_string(const char* field, size_t len) {
+  return std::string(field, strnlen(field, len));
+}
+
+// Reads a tar archive in one sequential pass. gzread decompresses gzip
+// streams inline and passes plain tar files through unchanged.
+static void process_tar(const std::string& path,
+                        const Opt& opt,
+                        FILE* writer) {
+  GzFile_ptr file(gzopen(resolve_path(path).c_str(), "rb"));
+  if (!file) {
+    printe("Warning: Skipping archive %s due to error opening file\n",
+           path.c_str());
+    return;
+  }
+  gzbuffer(file.get(), 1 << 20);
+
+  std::string long_name;
+  std::string content;
+  char header[512];
+  while (gz_read_fully(file.get(), header, sizeof(header))) {
+    if (std::all_of(header, header + sizeof(header),
+                    [](char c) { return c == 0; })) {
+      break;
+    }
+    unsigned checksum = 0;
+    for (size_t i = 0; i < sizeof(header); i++) {
+      checksum += (i >= 148 && i < 156) ? ' '
+                                        : static_cast<unsigned char>(header[i]);
+    }
+    if (checksum != parse_tar_number(header + 148, 8)) {
+      printe("Warning: Corrupt tar header in %s\n", path.c_str());
+      return;
+    }
+
+    uint64_t size = parse_tar_number(header + 124, 12);
+    uint64_t padded = (size + 511) & ~uint64_t(511);
+    char type = header[156];
+    std::string name = tar_string(header, 100);
+    if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+      name = tar_string(header + 345, 155) + "/" + name;
+    }
+
+    bool regular = type == '0' || type == '\0' || type == '7';
+    bool wanted = type == 'L' || type == 'x';
+    if (regular) {
+      if (!long_name.empty())
+        name = long_name;
+      long_name.clear();
+      while (name.compare(0, 2, "./") == 0)
+        name.erase(0, 2);
+      wanted = !should_ignore_member(name, opt) &&
+               opt.passes_stat_filters(size,
+                                       parse_tar_number(header + 136, 12));
+    } else if (!wanted) {
+      long_name.clear();
+    }
+
+    if (!wanted) {
+      if (gzseek(file.get(), padded, SEEK_CUR) < 0)
+        return;
+      continue;
+    }
+    content.resize(padded);
+    if (!gz_read_fully(file.get(), &content[0], padded)) {
+      printe("Warning: Truncated tar archive %s\n", path.c_str());
+      return;
+    }
+    content.resize(size);
+
+    if (type == 'L') {
+      long_name = content.c_str();
+    } else if (type == 'x') {
+      // pax extended header: "<len> <key>=<value>\n" records.
+      size_t pos = 0;
+      while (pos < content.size()) {
+        size_t len = strtoull(content.c_str() + pos, nullptr, 10);
+        size_t space = content.find(' ', pos);
+        if (len == 0 || space == std::string::npos ||
+            pos + len > content.size()) {
+          break;
+        }
+        std::string record = content.substr(space + 1, pos + len - space - 2);
+        if (record.compare(0, 5, "path=") == 0)
+          long_name = record.substr(5);
+        pos += len;
+      }
+    } else {
+      cap_content(content, opt);
+      emit_document(writer, path + "/" + name, content, opt,
+                    parse_tar_number(header + 136, 12));
+    }
+  }
+}
+
+struct ZipMember {
+  std::string name;
+  uint16_t method;
+  uint64_t compressed_size;
+  uint64_t size;
+  uint64_t local_offset;
+  int64_t mtime;
+};
+
+static uint16_t read_le16(const unsigned char* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_le32(const unsigned char* p) {
+  return read_le16(p) | (uint32_t(read_le16(p + 2)) << 16);
+}
+
+static uint64_t read_le64(const unsigned char* p) {
+  return read_le32(p) | (uint64_t(read_le32(p + 4)) << 32);
+}
+
+// Zip stores modification times as local-time MS-DOS date and time fields.
+static int64_t dos_time_to_unix(uint16_t time, uint16_t date) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_sec = (time & 0x1f) * 2;
+  tm.tm_min = (time >> 5) & 0x3f;
+  tm.tm_hour = time >> 11;
+  tm.tm_mday = date & 0x1f;
+  tm.tm_mon = ((date >> 5) & 0x0f) - 1;
+  tm.tm_year = (date >> 9) + 80;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+// Lists the members of a zip file from its central directory, including
+// zip64 sizes and offsets.
+static bool read_zip_directory(const MappedFile& zip,
+                               std::vector<ZipMember>& members) {
+  const unsigned char* p = zip.data();
+  size_t size = zip.size();
+  if (size < 22)
+    return false;
+  size_t eocd = size - 22;
+  size_t limit = size > 22 + 65535 ? size - 22 - 65535 : 0;
+  while (read_le32(p + eocd) != 0x06054b50) {
+    if (eocd == limit)
+      return false;
+    eocd--;
+  }
+
+  uint64_t count = read_le16(p + eocd + 10);
+  uint64_t cd_offset = read_le32(p + eocd + 16);
+  if (eocd >= 20 && read_le32(p + eocd - 20) == 0x07064b50) {
+    uint64_t zip64_eocd = read_le64(p + eocd - 20 + 8);
+    if (zip64_eocd + 56 <= size && read_le32(p + zip64_eocd) == 0x06064b50) {
+      count = read_le64(p + zip64_eocd + 32);
+      cd_offset = read_le64(p + zip64_eocd + 48);
+    }
+  }
+
+  size_t pos = cd_offset;
+  for (uint64_t i = 0; i < count; i++) {
+    if (pos + 46 > size || read_le32(p + pos) != 0x02014b50)
+      return false;
+    ZipMember member;
+    uint16_t flags = read_le16(p + pos + 8);
+    member.method = read_le16(p + pos + 10);
+    member.compressed_size = read_le32(p + pos + 20);
+    member.size = read_le32(p + pos + 24);
+    uint16_t name_len = read_le16(p + pos + 28);
+    uint16_t extra_len = read_le16(p + pos + 30);
+    uint16_t comment_len = read_le16(p + pos + 32);
+    member.local_offset = read_le32(p + pos + 42);
+    member.mtime = dos_time_to_unix(read_le16(p + pos + 12),
+                                    read_le16(p + pos + 14));
+    if (pos + 46 + name_len + extra_len > size)
+      return false;
+    member.name.assign(reinterpret_cast<const char*>(p + pos + 46), name_len);
+
+    const unsigned char* extra = p + pos + 46 + name_len;
+    const unsigned char* extra_end = extra + extra_len;
+    while (extra + 4 <= extra_end) {
+      uint16_t id = read_le16(extra);
+      uint16_t len = read_le16(extra + 2);
+      const unsigned char* field = extra + 4;
+      if (field + len > extra_end)
+        break;
+      if (id == 0x0001) {
+        const unsigned char* f = field;
+        uint64_t* values[] = {&member.size, &member.compressed_size,
+                              &member.local_offset};
+        for (uint64_t* value : values) {
+          if (*value == 0xffffffffu && f + 8 <= field + len) {
+            *value = read_le64(f);
+            f += 8;
+          }
+        }
+      }
+      extra = field + len;
+    }
+    pos += 46 + name_len + extra_len + comment_len;
+
+    if (flags & 1) {
+      printe("Warning: Skipping encrypted zip member %s\n",
+             member.name.c_str());
+      continue;
+    }
+    if (!member.name.empty() && member.name.back() != '/')
+      members.push_back(std::move(member));
+  }
+  return true;
+}
+
+static bool inflate_zip_member(const MappedFile& zip,
+                               const ZipMember& member,
+                               std::string& out) {
+  const unsigned char* p = zip.data();
+  uint64_t pos = member.local_offset;
+  if (pos + 30 > zip.size() || read_le32(p + pos) != 0x04034b50)
+    return false;
+  pos += 30 + read_le16(p + pos + 26) + read_le16(p + pos + 28);
+  if (pos > zip.size() || member.compressed_size > zip.size() - pos)
+    return false;
+
+  if (member.method == 0) {
+    if (member.compressed_size != member.size)
+      return false;
+    out.assign(reinterpret_cast<const char*>(p + pos), member.compressed_size);
+    return true;
+  }
+  if (member.method != 8)
+    return false;
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+    return false;
+  out.resize(member.size);
+  zs.next_in = const_cast<unsigned char*>(p + pos);
+  zs.avail_in = member.compressed_size;
+  zs.next_out = reinterpret_cast<unsigned char*>(&out[0]);
+  zs.avail_out = member.size;
+  int ret = member.size ? inflate(&zs, Z_FINISH) : Z_STREAM_END;
+  inflateEnd(&zs);
+  return ret == Z_STREAM_END && zs.total_out == member.size;
+}
+
+// Reads a zip file through its central directory. Members are inflated by
+// a pool of threads in batches and printed in directory order.
+static void process_zip(const std::string& path,
+                        const Opt& opt,
+                        FILE* writer) {
+  MappedFile zip;
+  std::vector<ZipMember> members;
+  if (!zip.open(resolve_path(path)) || !read_zip_directory(zip, members)) {
+    printe("Warning: Skipping archive %s due to error reading zip directory\n",
+           path.c_str());
+    return;
+  }
+  members.erase(
+      std::remove_if(members.begin(), members.end(),
+                     [&](const ZipMember& member) {
+                       return should_ignore_member(member.name, opt) ||
+                              !opt.passes_stat_filters(member.size,
+                                                       member.mtime);
+                     }),
+      members.end());
+
+  std::vector<std::string> contents(members.size());
+  std::vector<char> ok(members.size());
+  run_batched(
+      members.size(), worker_count(opt),
+      [&](size_t i) {
+        ok[i] = inflate_zip_member(zip, members[i], contents[i]);
+      },
+      [&](size_t i) {
+        std::string& content = contents[i];
+        if (!ok[i]) {
+          printe(
+              "Warning: Skipping zip member %s due to error inflating data\n",
+              members[i].name.c_str());
+        } else {
+          cap_content(content, opt);
+          emit_document(writer, path + "/" + members[i].name, content, opt,
+                        members[i].mtime);
+        }
+        std::string().swap(content);
+      });
+}
+
+// Compiled ignore files by path. Roots of one run share the files above
+// them and the global excludes, so each is read and compiled only once.
+static std::shared_ptr<const IgnoreRules> cached_ignore_file(
+    const std::string& file) {
+  std::string path = resolve_path(file);
+  if (serve_cache) {
+    size_t slash = path.rfind('/');
+    ServeCache::Dir* dir = serve_cache->dir(
+        slash == std::string::npos ? "." : slash ? path.substr(0, slash) : "/");
+    if (!dir)
+      return read_gitignore(AT_FDCWD, path.c_str());
+    std::string name = path.substr(slash + 1);
+    auto it = dir->ignore_files.find(name);
+    if (it == dir->ignore_files.end())
+      it = dir->ignore_files
+               .emplace(name, read_gitignore(AT_FDCWD, path.c_str()))
+               .first;
+    return it->second;
+  }
+  static std::unordered_map<std::string, std::shared_ptr<const IgnoreRules>>
+      cache;
+  auto it = cache.find(path);
+  if (it == cache.end())
+    it = cache.emplace(path, read_gitignore(AT_FDCWD, path.c_str())).first;
+  return it->second;
+}
+
+// core.excludesFile from the system, global and repository config files,
+// the last one set winning, or git's default of $XDG_CONFIG_HOME/git/ignore.
+static std::string excludes_file_path(const GitRepo& repo) {
+  const char* home = getenv("HOME");
+  const char* xdg = getenv("XDG_CONFIG_HOME");
+  std::string config_home = xdg && *xdg ? xdg
+                            : home      ? std::string(home) + "/.config"
+                                        : "";
+  std::vector<std::string> configs = {"/etc/gitconfig"};
+  if (!config_home.empty())
+    configs.push_back(config_home + "/git/config");
+  if (home)
+    configs.push_back(std::string(home) + "/.gitconfig");
+  configs.push_back(repo.common_dir() + "/config");
+
+  std::string result =
+      config_home.empty() ? "" : config_home + "/git/ignore";
+  auto trim = [](const std::string& s) {
+    size_t begin = s.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+      return std::string();
+    return s.substr(begin, s.find_last_not_of(" \t\r\n") + 1 - begin);
+  };
+  for (const auto& config : configs) {
+    FILE_ptr file(fopen(config.c_str(), "r"));
+    if (!file)
+      continue;
+    std::string line;
+    bool in_core = false;
+    while (getline(line, file.get()) != -1) {
+      line = trim(line);
+      if (line.empty() || line[0] == '#' || line[0] == ';')
+        continue;
+      if (line[0] == '[') {
+        in_core = strncasecmp(line.c_str(), "[core]", 6) == 0;
+        continue;
+      }
+      size_t eq = line.find('=');
+      if (!in_core || eq == std::string::npos ||
+          strcasecmp(trim(line.substr(0, eq)).c_str(), "excludesfile"))
+        continue;
+      std::string value = trim(line.substr(eq + 1));
+      if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+        value = value.substr(1, value.size() - 2);
+      if (value.compare(0, 2, "~/") == 0 && home)
+        value = home + value.substr(1);
+      result = value;
+    }
+  }
+  return result;
+}
+
+// Pushes the rules that apply to `root` from outside it, lowest precedence
+// first: core.excludesFile, .git/info/exclude, then the .gitignore files of
+// the directories from the top of the work tree down to root's parent.
+// Outside a work tree only the files at and below `root` apply.
+static void push_outer_ignores(const std::string& root,
+                               size_t root_len,
+                               IgnoreStack& ignores) {
+  GitRepo repo;
+  if (!repo.locate(root) || repo.work_tree().empty())
+    return;
+  std::error_code ec;
+  fs::path dir = fs::absolute(resolve_path(root), ec).lexically_normal();
+  fs::path top = fs::absolute(repo.work_tree(), ec).lexically_normal();
+  if (dir.filename().empty())
+    dir = dir.parent_path();
+  if (top.filename().empty())
+    top = top.parent_path();
+  fs::path rel = dir.lexically_relative(top);
+  if (ec || rel.empty() || *rel.begin() == "..")
+    return;
+
+  auto push = [&](const std::string& file, const fs::path& base) {
+    auto rules = cached_ignore_file(file);
+    if (!rules)
+      return;
+    fs::path outer = dir.lexically_relative(base);
+    ignores.push(std::move(rules), root_len,
+                 outer == "." ? "" : outer.string() + "/");
+  };
+  std::string excludes = excludes_file_path(repo);
+  if (!excludes.empty())
+    push(excludes, top);
+  push(repo.common_dir() + "/info/exclude", top);
+  if (rel == ".")
+    return;
+  fs::path base = top;
+  for (const auto& part : rel) {
+    push((base / ".gitignore").string(), base);
+    base /= part;
+  }
+}
+
+static void process_directory(const std::string& path,
+                              const Opt& opt,
+                              FILE* writer) {
+  int dir_fd =
+      open(resolve_path(path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    printe("Warning: Skipping directory %s due to error opening it\n",
+           path.c_str());
+    return;
+  }
+  std::string walk_path = path;
+  if (walk_path.back() != '/')
+    walk_path += '/';
+  IgnoreStack ignores;
+  if (!opt.ignore_gitignore)
+    push_outer_ignores(path, walk_path.size(), ignores);
+  walk_directory(dir_fd, walk_path, opt, ignores, writer, 1);
+}
+
+static void process_path(const std::string& path,
+                         const Opt& opt,
+                         FILE* writer) {
+  std::string full_path = resolve_path(path);
+  if (fs::is_regular_file(full_path)) {
+    switch (archive_kind(path)) {
+      case ARCHIVE_TAR:
+        process_tar(path, opt, writer);
+        break;
+      case ARCHIVE_ZIP:
+        process_zip(path, opt, writer);
+        break;
+      case ARCHIVE_NONE: {
+        struct stat st;
+        if (!opt.has_stat_filters() ||
+            (stat(full_path.c_str(), &st) == 0 &&
+             opt.passes_stat_filters(st.st_size, st.st_mtime))) {
+          process_file(AT_FDCWD, full_path.c_str(), path, opt, writer);
+        }
+        break;
+      }
+    }
+  } else if (fs::is_directory(full_path)) {
+    process_directory(path, opt, writer);
+  }
+}
+
+// Reads the paths listed in `list`, one per line or NUL-terminated with
+// -0, treating each like a path given on the command line. There is no
+// walk: regular files are read and transformed on the worker pool and
+// printed in list order, while directories and archives go through
+// process_path.
+static void process_files_from(FILE* list, const Opt& opt, FILE* writer) {
+  enum Action { SKIP, PRINT, PROCESS_PATH };
+  struct Item {
+    std::string path;
+    std::string content;
+    int64_t mtime;
+    Action action;
+    std::vector<Chunk> chunks = {};
+  };
+  const size_t list_batch = 4096;
+  const int delimiter = opt.null_separated ? '\0' : '\n';
+  std::vector<Item> items;
+  char* line = nullptr;
+  size_t capacity = 0;
+  bool done = false;
+  while (!done) {
+    items.clear();
+    while (items.size() < list_batch) {
+      ssize_t len = ::getdelim(&line, &capacity, delimiter, list);
+      if (len < 0) {
+        done = true;
+        break;
+      }
+      if (len > 0 && line[len - 1] == delimiter)
+        --len;
+      if (!opt.null_separated && len > 0 && line[len - 1] == '\r')
+        --len;
+      if (len > 0)
+        items.push_back({std::string(line, len), "", -1, SKIP});
+    }
+
+    run_batched(
+        items.size(), worker_count(opt),
+        [&](size_t i) {
+          Item& item = items[i];
+          if (archive_kind(item.path) != ARCHIVE_NONE) {
+            item.action = PROCESS_PATH;
+            return;
+          }
+          int fd = open(resolve_path(item.path).c_str(),
+                        O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+          struct stat st;
+          if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0)
+              close(fd);
+            printe("Warning: Skipping file %s due to error opening file\n",
+                   item.path.c_str());
+            return;
+          }
+          if (!S_ISREG(st.st_mode)) {
+            item.action = PROCESS_PATH;
+          } else if (!opt.has_stat_filters() ||
+                     opt.passes_stat_filters(st.st_size, st.st_mtime)) {
+            item.mtime = st.st_mtime;
+            if (read_fd_content(fd, st.st_size, item.path, opt,
+                                item.content) &&
+                prepare_document(item.path, item.content, opt, item.chunks))
+              item.action = PRINT;
+          }
+          close(fd);
+        },
+        [&](size_t i) {
+          Item& item = items[i];
+          if (item.action == PRINT)
+            print_chunks(writer, item.path, item.content, item.chunks, opt,
+                         item.mtime);
+          else if (item.action == PROCESS_PATH)
+            process_path(item.path, opt, writer);
+          std::string().swap(item.content);
+          std::vector<Chunk>().swap(item.chunks);
+        });
+  }
+  free(line);
+}
+
+// Builds the matchers that options only describe. Returns non-zero if a
+// pattern does not compile.
+static int compile_options(Opt& opt) {
+  if (!opt.ignore_patterns.empty()) {
+    auto globs = std::make_shared<GlobSet>();
+    for (const auto& pattern : opt.ignore_patterns)
+      globs->add(pattern);
+    opt.ignore_globs = std::move(globs);
+  }
+  if (!opt.grep_patterns.empty() || !opt.grep_not_patterns.empty()) {
+    opt.grep = GrepFilter::create(opt.grep_patterns, opt.grep_not_patterns);
+    if (!opt.grep) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Walks every source the options name and prints what it finds.
+static int print_sources(const Opt& opt, FILE* list, FILE* writer) {
+  if (!opt.git_rev.empty()) {
+    return process_git_rev(opt, writer);
+  }
+  if (opt.dirty || !opt.changed_since.empty()) {
+    return process_git_changes(opt, writer);
+  }
+
+  // Check every path before the header goes out, so that an error never
+  // leaves an unterminated <documents> element or JSON array behind.
+  for (const auto& path : opt.paths) {
+    if (!fs::exists(resolve_path(path))) {
+      printe("Path does not exist: %s\n", path.c_str());
+      return 1;
+    }
+  }
+  print_header(writer, opt);
+  for (const auto& path : opt.paths) {
+    process_path(path, opt, writer);
+  }
+  if (list) {
+    process_files_from(list, opt, writer);
+  }
+  print_footer(writer, opt);
+
+  return 0;
+}
+
+// Produces the whole output for one set of options, to `out` unless they
+// name an output file or a pattern for split parts.
+static int run(const Opt& opt, FILE* out) {
+  bool split = opt.split_tokens || opt.split_bytes;
+  FILE* writer = split ? nullptr : out;
+  FILE_ptr file_out;
+  if (!opt.output_file.empty() && !split) {
+    file_out.reset(fopen(resolve_path(opt.output_file).c_str(), "w"));
+    writer = file_out.get();
+  }
+
+  // Declared after file_out so the stream is drained before it is closed.
+  std::unique_ptr<AsyncWriter> async_writer;
+  FILE_ptr async_out;
+  if (writer && opt.max_output_lag) {
+    fflush(writer);
+    async_writer.reset(new AsyncWriter(fileno(writer), opt.max_output_lag));
+    async_out.reset(async_writer->open_stream());
+    if (async_out) {
+      writer = async_out.get();
+    }
+  }
+
+  FILE* list = nullptr;
+  FILE_ptr list_file;
+  if (!opt.files_from.empty()) {
+    if (opt.files_from == "-") {
+      list = stdin;
+    } else {
+      list_file.reset(fopen(resolve_path(opt.files_from).c_str(), "r"));
+      list = list_file.get();
+    }
+    if (!list) {
+      printe("Cannot open file list: %s\n", opt.files_from.c_str());
+      return 1;
+    }
+  }
+
+  if (!split) {
+    return print_sources(opt, list, writer);
+  }
+  OutputSplitter splitter(opt);
+  output_splitter = &splitter;
+  int rc = print_sources(opt, list, writer);
+  output_splitter = nullptr;
+  if (!splitter.finish())
+    rc = 1;
+  return rc;
+}
+
+// Produces the output in a sealed memfd and passes the descriptor over the
+// Unix socket `sock_fd`, or over a connection to opt.send_memfd if it is
+// -1. The consumer can mmap it without copying; the seals guarantee the
+// contents never change underneath it. The message carries the output
+// size as a native-endian uint64_t.
+static int run_to_memfd(const Opt& opt, int sock_fd) {
+  int memfd = memfd_create("files-to-prompt", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd < 0) {
+    printe("Cannot create memfd: %s\n", strerror(errno));
+    return 1;
+  }
+  FILE_ptr out(fdopen(dup(memfd), "w"));
+  int rc = out ? run(opt, out.get()) : 1;
+  bool ok = out && fflush(out.get()) == 0 && !ferror(out.get());
+  out.reset();
+  struct stat st;
+  ok = ok && fstat(memfd, &st) == 0 &&
+       fcntl(memfd, F_ADD_SEALS,
+             F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+
+  int conn = sock_fd;
+  if (ok && conn < 0) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ok = conn >= 0 && opt.send_memfd.size() < sizeof(addr.sun_path);
+    if (ok) {
+      memcpy(addr.sun_path, opt.send_memfd.c_str(), opt.send_memfd.size() + 1);
+      ok = connect(conn, reinterpret_cast<struct sockaddr*>(&addr),
+                   sizeof(addr)) == 0;
+    }
+  }
+  if (ok) {
+    uint64_t size = st.st_size;
+    struct iovec iov = {&size, sizeof(size)};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    ssize_t sent;
+    while ((sent = sendmsg(conn, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    ok = sent == sizeof(size);
+  }
+  if (!ok) {
+    printe("Cannot hand over output through %s: %s\n",
+           sock_fd >= 0 ? "the connection" : opt.send_memfd.c_str(),
+           strerror(errno));
+    rc = 1;
+  }
+  if (conn >= 0 && conn != sock_fd)
+    close(conn);
+  close(memfd);
+  return rc;
+}
+
+// Reads one request and streams its output back on the connection.
+// Reads a request: its number of strings in decimal, then the strings,
+// each terminated by a NUL byte. The count lets arguments be empty.
+static bool read_request(int conn, std::vector<std::string>& args) {
+  std::string request;
+  size_t count = 0;
+  size_t pos = 0;
+  while (true) {
+    size_t nul;
+    while ((nul = request.find('\0', pos)) != std::string::npos) {
+      std::string field = request.substr(pos, nul - pos);
+      pos = nul + 1;
+      if (count == 0) {
+        char* end;
+        count = strtoul(field.c_str(), &end, 10);
+        if (field.empty() || *end || count == 0 || count > (1 << 16))
+          return false;
+        continue;
+      }
+      args.push_back(std::move(field));
+      if (args.size() == count)
+        return true;
+    }
+    char buf[4096];
+    ssize_t n = read(conn, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0 || request.size() > (1 << 20))
+      return false;
+    request.append(buf, n);
+  }
+}
+
+// Every reply starts with a status byte: '0' if the request was accepted
+// and its output follows, '1' if it was rejected and a message follows.
+static void send_status(int conn, char status, const std::string& message) {
+  std::string reply = status + message;
+  ssize_t n;
+  do {
+    n = write(conn, reply.data(), reply.size());
+  } while (n < 0 && errno == EINTR);
+}
+
+static void handle_request(int conn) {
+  std::vector<std::string> args;
+  if (!read_request(conn, args)) {
+    send_status(conn, '1', "Malformed request\n");
+    return;
+  }
+  // Relative paths of the request resolve against its directory through
+  // base_dir, so it must be absolute.
+  struct stat st;
+  if (args[0].empty() || args[0][0] != '/' ||
+      stat(args[0].c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    printe("Warning: Skipping request for inaccessible directory %s\n",
+           args[0].c_str());
+    send_status(conn, '1', "Not an absolute path to a directory: " + args[0] +
+                               "\n");
+    return;
+  }
+  base_dir = args[0];
+  std::vector<char*> argv = {const_cast<char*>("files-to-prompt.cpp")};
+  for (size_t i = 1; i < args.size(); i++)
+    argv.push_back(&args[i][0]);
+  argv.push_back(nullptr);
+
+  optind = 0;
+  Opt opt;
+  if (opt.init(argv.size() - 1, argv.data()) || compile_options(opt)) {
+    send_status(conn, '1', "Invalid arguments, see the server log\n");
+    return;
+  }
+  if (!opt.serve.empty() || opt.files_from == "-") {
+    printe("Warning: Skipping request using --serve or --files-from -\n");
+    send_status(conn, '1', "--serve and --files-from - cannot be served\n");
+    return;
+  }
+  if (serve_cache)
+    serve_cache->sync();
+  global_index = 1;
+  send_status(conn, '0', "");
+  if (!opt.send_memfd.empty()) {
+    run_to_memfd(opt, opt.send_memfd == "-" ? conn : -1);
+    return;
+  }
+  FILE_ptr out(fdopen(dup(conn), "w"));
+  if (out) {
+    run(opt, out.get());
+  }
+}
+
+// Answers requests on a Unix socket until killed, one at a time. A
+// request is the client's working directory followed by command line
+// arguments (see read_request). After a status byte the output is
+// streamed back and the connection closed.
+static int serve(const Opt& opt) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (opt.serve.size() >= sizeof(addr.sun_path)) {
+    printe("Socket path too long: %s\n", opt.serve.c_str());
+    return 1;
+  }
+  memcpy(addr.sun_path, opt.serve.c_str(), opt.serve.size() + 1);
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(opt.serve.c_str());
+  // Requests read files as this user, so only this user may connect. The
+  // umask makes bind create the socket 0600 with no window in between.
+  mode_t old_umask = umask(0177);
+  bool bound = listener >= 0 &&
+               bind(listener, reinterpret_cast<struct sockaddr*>(&addr),
+                    sizeof(addr)) == 0;
+  umask(old_umask);
+  if (!bound || listen(listener, 64) != 0) {
+    printe("Cannot listen on %s: %s\n", opt.serve.c_str(), strerror(errno));
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  ServeCache cache(opt.cache_size);
+  if (cache.ok()) {
+    serve_cache = &cache;
+  } else {
+    printe("Warning: inotify is unavailable, serving without caches\n");
+  }
+  while (true) {
+    int conn = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      printe("Cannot accept connection: %s\n", strerror(errno));
+      return 1;
+    }
+    handle_request(conn);
+    close(conn);
+  }
+}
+
+int main(int argc, char** argv) {
+  Opt opt;
+  if (opt.init(argc, argv)) {
+    return 1;
+  }
+  if (!opt.serve.empty()) {
+    return serve(opt);
+  }
+  if (compile_options(opt)) {
+    return 1;
+  }
+  if (!opt.send_memfd.empty()) {
+    return run_to_memfd(opt, opt.send_memfd == "-" ? STDOUT_FILENO : -1);
+  }
+  return run(opt, stdout);
 }
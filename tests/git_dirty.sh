@@ -0,0 +1,30 @@
+#!/bin/sh
+# --dirty on a fresh clone, whose entries are all racily clean, prints
+# nothing; a same-size edit is still found.
+set -eu
+bin=$1
+command -v git > /dev/null || exit 77
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+git init -q origin
+echo one > origin/a.txt
+echo two > origin/b.txt
+git -C origin add .
+git -C origin -c user.name=t -c user.email=t@t commit -qm init
+git clone -q origin clone
+cd clone
+
+actual=$("$bin" --dirty)
+if [ -n "$actual" ]; then
+  printf 'expected no output on a fresh clone, got:\n%s\n' "$actual" >&2
+  exit 1
+fi
+
+echo ONE > a.txt
+actual=$("$bin" --dirty | head -n 1)
+if [ "$actual" != a.txt ]; then
+  printf 'expected a.txt to be dirty, got:\n%s\n' "$actual" >&2
+  exit 1
+fi
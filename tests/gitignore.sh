@@ -0,0 +1,21 @@
+#!/bin/sh
+# .gitignore patterns whose first character is special but not '*' must
+# be matched as globs, the way git matches them.
+set -eu
+bin=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+printf '?foo\n[A-Z]bc.txt\n\\#foo\n' > .gitignore
+for name in foo abcfoo a#foo xfoo xyfoo Abc.txt abc.txt '#foo'; do
+  echo x > "$name"
+done
+
+actual=$("$bin" --format jsonl . | sed -n 's/.*"path":"\.\/\([^"]*\)".*/\1/p' |
+         sort)
+expected=$(printf '%s\n' a#foo abc.txt abcfoo foo xyfoo | sort)
+if [ "$actual" != "$expected" ]; then
+  printf 'expected:\n%s\nactual:\n%s\n' "$expected" "$actual" >&2
+  exit 1
+fi
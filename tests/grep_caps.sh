@@ -0,0 +1,23 @@
+#!/bin/sh
+# --grep and --grep-not see the whole file even when the content caps cut
+# the match out of what is printed.
+set -eu
+bin=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+{ seq 1000; echo NEEDLE; } > match.txt
+seq 1000 > plain.txt
+
+actual=$("$bin" --grep NEEDLE --max-file-lines 2 . | head -n 1)
+if [ "$actual" != ./match.txt ]; then
+  printf 'expected --grep to keep ./match.txt, got:\n%s\n' "$actual" >&2
+  exit 1
+fi
+actual=$("$bin" --grep-not NEEDLE --max-file-bytes 100 . | head -n 1)
+if [ "$actual" != ./plain.txt ]; then
+  printf 'expected --grep-not to keep only ./plain.txt, got:\n%s\n' \
+    "$actual" >&2
+  exit 1
+fi